@@ -18,6 +18,9 @@ public:
             const char *address = nullptr, const std::vector<const char *> &ignore_alive = {});
   void update(int timeout = 1000);
   void update_msgs(uint64_t current_time, const std::vector<std::pair<std::string, cereal::Event::Reader>> &messages);
+  // Updates the services from serialized events, keyed by the index of the service in the Event union.
+  // The events are read in place, without a copy, and must stay valid until they are updated again.
+  void update_msgs(uint64_t current_time, const std::vector<std::pair<cereal::Event::Which, kj::ArrayPtr<const capnp::word>>> &messages);
   inline bool allAlive(const std::vector<const char *> &service_list = {}) { return all_(service_list, false, true); }
   inline bool allValid(const std::vector<const char *> &service_list = {}) { return all_(service_list, true, false); }
   inline bool allAliveAndValid(const std::vector<const char *> &service_list = {}) { return all_(service_list, true, true); }
@@ -34,10 +37,13 @@ public:
 
 private:
   bool all_(const std::vector<const char *> &service_list, bool valid, bool alive);
-  Poller *poller_ = nullptr;
   struct SubMessage;
+  void setMessage(SubMessage *m, cereal::Event::Reader event, uint64_t current_time);
+  void updateAlive(uint64_t current_time);
+  Poller *poller_ = nullptr;
   std::map<SubSocket *, SubMessage *> messages_;
   std::map<std::string, SubMessage *> services_;
+  std::vector<SubMessage *> services_by_which_;
 };
 
 class MessageBuilder : public capnp::MallocMessageBuilder {
@@ -77,6 +83,7 @@ public:
   PubMaster(const std::vector<const char *> &service_list);
   inline int send(const char *name, capnp::byte *data, size_t size) { return sockets_.at(name)->send((char *)data, size); }
   int send(const char *name, MessageBuilder &msg);
+  inline bool all_readers_updated(const char *name) { return sockets_.at(name)->all_readers_updated(); }
   ~PubMaster();
 
 private:
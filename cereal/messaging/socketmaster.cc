@@ -3,6 +3,8 @@
 #include <string>
 #include <mutex>
 
+#include <capnp/schema.h>
+
 #include "cereal/services.h"
 #include "cereal/messaging/messaging.h"
 
@@ -64,6 +66,10 @@ SubMaster::SubMaster(const std::vector<const char *> &service_list, const std::v
     m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader({});
     messages_[socket] = m;
     services_[name] = m;
+
+    uint16_t which = capnp::Schema::from<cereal::Event>().asStruct().getFieldByName(name).getProto().getDiscriminantValue();
+    if (which >= services_by_which_.size()) services_by_which_.resize(which + 1, nullptr);
+    services_by_which_[which] = m;
   }
 }
 
@@ -108,15 +114,37 @@ void SubMaster::update_msgs(uint64_t current_time, const std::vector<std::pair<s
     if (m_find == services_.end()){
       continue;
     }
-    SubMessage *m = m_find->second;
-    m->event = kv.second;
-    m->updated = true;
-    m->rcv_time = current_time;
-    m->rcv_frame = frame;
-    m->valid = m->event.getValid();
-    if (SIMULATION) m->alive = true;
+    setMessage(m_find->second, kv.second, current_time);
+  }
+  updateAlive(current_time);
+}
+
+void SubMaster::update_msgs(uint64_t current_time, const std::vector<std::pair<cereal::Event::Which, kj::ArrayPtr<const capnp::word>>> &messages) {
+  if (++frame == UINT64_MAX) frame = 1;
+
+  capnp::ReaderOptions options;
+  options.traversalLimitInWords = kj::maxValue; // Don't limit
+  for (auto &[which, data] : messages) {
+    SubMessage *m = which < services_by_which_.size() ? services_by_which_[which] : nullptr;
+    if (m == nullptr) continue;
+
+    m->msg_reader->~FlatArrayMessageReader();
+    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader(data, options);
+    setMessage(m, m->msg_reader->getRoot<cereal::Event>(), current_time);
   }
+  updateAlive(current_time);
+}
+
+void SubMaster::setMessage(SubMessage *m, cereal::Event::Reader event, uint64_t current_time) {
+  m->event = event;
+  m->updated = true;
+  m->rcv_time = current_time;
+  m->rcv_frame = frame;
+  m->valid = m->event.getValid();
+  if (SIMULATION) m->alive = true;
+}
 
+void SubMaster::updateAlive(uint64_t current_time) {
   if (!SIMULATION) {
     for (auto &kv : messages_) {
       SubMessage *m = kv.second;
@@ -1,6 +1,7 @@
 #include "tools/cabana/chart/chart.h"
 
 #include <algorithm>
+#include <cmath>
 #include <limits>
 
 #include <QActionGroup>
@@ -218,6 +219,9 @@ void ChartView::updatePlotArea(int left_pos, bool force) {
     x_label_size += QSizeF{5, 5};
     chart()->setPlotArea(rect().adjusted(align_to + left, adjust_top + top, -x_label_size.width() / 2 - right, -x_label_size.height() - bottom));
     chart()->layout()->invalidate();
+    for (auto &s : sigs) {
+      replaceSeriesPoints(s);
+    }
     resetChartCache();
   }
 }
@@ -249,6 +253,9 @@ void ChartView::updatePlot(double cur, double min, double max) {
   if (min != axis_x->min() || max != axis_x->max()) {
     axis_x->setRange(min, max);
     updateAxisY();
+    for (auto &s : sigs) {
+      replaceSeriesPoints(s);
+    }
     updateSeriesPoints();
     // update tooltip
     if (tooltip_x >= 0) {
@@ -282,23 +289,30 @@ void ChartView::updateSeriesPoints() {
   }
 }
 
-void ChartView::appendCanEvents(const cabana::Signal *sig, const std::vector<const CanEvent *> &events,
-                                std::vector<QPointF> &vals, std::vector<QPointF> &step_vals) {
-  vals.reserve(vals.size() + events.capacity());
-  step_vals.reserve(step_vals.size() + events.capacity() * 2);
+void ChartView::appendSeries(SignalSeries::const_iterator first, SignalSeries::const_iterator last,
+                             std::vector<QPointF> &vals, std::vector<QPointF> &step_vals) {
+  vals.reserve(vals.size() + (last - first));
+  step_vals.reserve(step_vals.size() + (last - first) * 2);
 
-  double value = 0;
-  for (const CanEvent *e : events) {
-    if (sig->getValue(e->dat, e->size, &value)) {
-      const double ts = can->toSeconds(e->mono_time);
-      vals.emplace_back(ts, value);
-      if (!step_vals.empty())
-        step_vals.emplace_back(ts, step_vals.back().y());
-      step_vals.emplace_back(ts, value);
-    }
+  for (auto it = first; it != last; ++it) {
+    const SeriesPoint p = *it;
+    if (std::isnan(p.value)) continue;
+
+    const double ts = can->toSeconds(p.mono_time);
+    vals.emplace_back(ts, p.value);
+    if (!step_vals.empty())
+      step_vals.emplace_back(ts, step_vals.back().y());
+    step_vals.emplace_back(ts, p.value);
   }
 }
 
+// replaces the points of the series with the M4 decimation of the visible range
+void ChartView::replaceSeriesPoints(SigItem &s) {
+  const auto &vals = series_type == SeriesType::StepLine ? s.step_vals : s.vals;
+  auto points = s.lod.decimate(vals, axis_x->min(), axis_x->max(), chart()->plotArea().width());
+  s.series->replace(QVector<QPointF>::fromStdVector(points));
+}
+
 void ChartView::updateSeries(const cabana::Signal *sig, const MessageEventsMap *msg_new_events) {
   for (auto &s : sigs) {
     if (!sig || s.sig == sig) {
@@ -310,11 +324,26 @@ void ChartView::updateSeries(const cabana::Signal *sig, const MessageEventsMap *
       auto it = events->find(s.msg_id);
       if (it == events->end() || it->second.empty()) continue;
 
-      if (s.vals.empty() || can->toSeconds(it->second.back()->mono_time) > s.vals.back().x()) {
-        appendCanEvents(s.sig, it->second, s.vals, s.step_vals);
+      // the new events are already decoded into the shared series, take the values in their time range
+      const auto series = can->series(s.msg_id, s.sig);
+      auto first = series->begin(), last = series->end();
+      if (msg_new_events) {
+        first = std::lower_bound(first, last, it->second.front().mono_time, [](const SeriesPoint &p, uint64_t ts) {
+          return p.mono_time < ts;
+        });
+        last = std::upper_bound(first, last, it->second.back().mono_time, [](uint64_t ts, const SeriesPoint &p) {
+          return ts < p.mono_time;
+        });
+      }
+      if (first == last) continue;
+
+      if (s.vals.empty() || can->toSeconds((*std::prev(last)).mono_time) > s.vals.back().x()) {
+        appendSeries(first, last, s.vals, s.step_vals);
       } else {
         std::vector<QPointF> vals, step_vals;
-        appendCanEvents(s.sig, it->second, vals, step_vals);
+        appendSeries(first, last, vals, step_vals);
+        if (vals.empty()) continue;
+
         s.vals.insert(std::lower_bound(s.vals.begin(), s.vals.end(), vals.front().x(), xLessThan),
                       vals.begin(), vals.end());
         s.step_vals.insert(std::lower_bound(s.step_vals.begin(), s.step_vals.end(), step_vals.front().x(), xLessThan),
@@ -323,8 +352,9 @@ void ChartView::updateSeries(const cabana::Signal *sig, const MessageEventsMap *
 
       if (!can->liveStreaming()) {
         s.segment_tree.build(s.vals);
+        s.lod.build(series_type == SeriesType::StepLine ? s.step_vals : s.vals);
       }
-      s.series->replace(QVector<QPointF>::fromStdVector(series_type == SeriesType::StepLine ? s.step_vals : s.vals));
+      replaceSeriesPoints(s);
     }
   }
   updateAxisY();
@@ -838,7 +868,10 @@ void ChartView::setSeriesType(SeriesType type) {
     }
     for (auto &s : sigs) {
       s.series = createSeries(series_type, s.sig->color);
-      s.series->replace(QVector<QPointF>::fromStdVector(series_type == SeriesType::StepLine ? s.step_vals : s.vals));
+      if (!can->liveStreaming()) {
+        s.lod.build(series_type == SeriesType::StepLine ? s.step_vals : s.vals);
+      }
+      replaceSeriesPoints(s);
     }
     updateSeriesPoints();
     updateTitle();
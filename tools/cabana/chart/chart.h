@@ -49,6 +49,7 @@ public:
     std::vector<QPointF> step_vals;
     QPointF track_pt{};
     SegmentTree segment_tree;
+    M4Pyramid lod;
     double min = 0;
     double max = 0;
   };
@@ -65,8 +66,9 @@ private slots:
   void signalRemoved(const cabana::Signal *sig) { removeIf([=](auto &s) { return s.sig == sig; }); }
 
 private:
-  void appendCanEvents(const cabana::Signal *sig, const std::vector<const CanEvent *> &events,
-                       std::vector<QPointF> &vals, std::vector<QPointF> &step_vals);
+  void appendSeries(SignalSeries::const_iterator first, SignalSeries::const_iterator last,
+                    std::vector<QPointF> &vals, std::vector<QPointF> &step_vals);
+  void replaceSeriesPoints(SigItem &s);
   void createToolButtons();
   void addSeries(QXYSeries *series);
   void contextMenuEvent(QContextMenuEvent *event) override;
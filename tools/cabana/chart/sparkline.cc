@@ -7,6 +7,7 @@
 void Sparkline::update(const MessageId &msg_id, const cabana::Signal *sig, double last_msg_ts, int range, QSize size) {
   const auto &msgs = can->events(msg_id);
 
+  // only the events in the range are decoded, the shared series would decode the whole history
   auto range_start = can->toMonoTime(last_msg_ts - range);
   auto range_end = can->toMonoTime(last_msg_ts);
   auto first = std::lower_bound(msgs.cbegin(), msgs.cend(), range_start, CompareCanEvent());
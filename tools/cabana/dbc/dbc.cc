@@ -1,6 +1,8 @@
 #include "tools/cabana/dbc/dbc.h"
 
 #include <algorithm>
+#include <cstring>
+#include <limits>
 
 #include "tools/cabana/utils/util.h"
 
@@ -166,6 +168,16 @@ bool cabana::Signal::getValue(const uint8_t *data, size_t data_size, double *val
   return true;
 }
 
+void cabana::Signal::getValues(const uint8_t *data, size_t stride, const uint8_t *sizes, size_t count, double *vals) const {
+  for (size_t i = 0; i < count; ++i, data += stride) {
+    if (multiplexor && get_raw_value(data, sizes[i], *multiplexor) != multiplex_value) {
+      vals[i] = std::numeric_limits<double>::quiet_NaN();
+    } else {
+      vals[i] = get_raw_value(data, sizes[i], *this);
+    }
+  }
+}
+
 bool cabana::Signal::operator==(const cabana::Signal &other) const {
   return name == other.name && size == other.size &&
          start_bit == other.start_bit &&
@@ -178,7 +190,8 @@ bool cabana::Signal::operator==(const cabana::Signal &other) const {
 
 // helper functions
 
-double get_raw_value(const uint8_t *data, size_t data_size, const cabana::Signal &sig) {
+// bit by bit, for signals the plan doesn't cover
+static double get_raw_value_slow(const uint8_t *data, size_t data_size, const cabana::Signal &sig) {
   int64_t val = 0;
 
   int i = sig.msb / 8;
@@ -194,12 +207,31 @@ double get_raw_value(const uint8_t *data, size_t data_size, const cabana::Signal
     bits -= size;
     i = sig.is_little_endian ? i - 1 : i + 1;
   }
-  if (sig.is_signed) {
+  if (sig.is_signed && sig.size < 64) {
     val -= ((val >> (sig.size - 1)) & 0x1) ? (1ULL << sig.size) : 0;
   }
   return val * sig.factor + sig.offset;
 }
 
+double get_raw_value(const uint8_t *data, size_t data_size, const cabana::Signal &sig) {
+  const auto &p = sig.plan;
+  if (p.num_bytes == 0 || p.first_byte + p.num_bytes > data_size) {
+    return get_raw_value_slow(data, data_size, sig);
+  }
+
+  uint64_t raw = 0;
+  if (p.first_byte + 8 <= data_size) {
+    memcpy(&raw, data + p.first_byte, sizeof(raw));
+    if (!sig.is_little_endian) raw = __builtin_bswap64(raw);
+  } else if (sig.is_little_endian) {
+    for (int i = 0; i < p.num_bytes; ++i) raw |= (uint64_t)data[p.first_byte + i] << (i * 8);
+  } else {
+    for (int i = 0; i < p.num_bytes; ++i) raw |= (uint64_t)data[p.first_byte + i] << (56 - i * 8);
+  }
+  const uint64_t val = ((raw >> p.shift) & p.mask) ^ p.sign_bit;
+  return (int64_t)(val - p.sign_bit) * sig.factor + sig.offset;
+}
+
 void updateMsbLsb(cabana::Signal &s) {
   if (s.is_little_endian) {
     s.lsb = s.start_bit;
@@ -208,4 +240,18 @@ void updateMsbLsb(cabana::Signal &s) {
     s.lsb = flipBitPos(flipBitPos(s.start_bit) + s.size - 1);
     s.msb = s.start_bit;
   }
+
+  auto &p = s.plan;
+  p = {};
+  if (s.size <= 0 || s.size > 64 || s.lsb < 0 || s.msb < 0) return;
+
+  // little endian signals grow from the lsb byte up, big endian ones from the msb byte up
+  p.first_byte = s.is_little_endian ? s.lsb / 8 : s.msb / 8;
+  const int num_bytes = std::abs(s.msb / 8 - s.lsb / 8) + 1;
+  if (num_bytes > 8) return;
+
+  p.num_bytes = num_bytes;
+  p.shift = s.is_little_endian ? s.lsb % 8 : 64 - num_bytes * 8 + s.lsb % 8;
+  p.mask = s.size == 64 ? ~0ULL : (1ULL << s.size) - 1;
+  p.sign_bit = s.is_signed ? 1ULL << (s.size - 1) : 0;
 }
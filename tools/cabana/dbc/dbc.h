@@ -55,6 +55,8 @@ public:
   Signal(const Signal &other) = default;
   void update();
   bool getValue(const uint8_t *data, size_t data_size, double *val) const;
+  // Decodes count payloads stored stride bytes apart. Events that carry another multiplex value get NaN.
+  void getValues(const uint8_t *data, size_t stride, const uint8_t *sizes, size_t count, double *vals) const;
   QString formatValue(double value, bool with_unit = true) const;
   bool operator==(const cabana::Signal &other) const;
   inline bool operator!=(const cabana::Signal &other) const { return !(*this == other); }
@@ -83,6 +85,16 @@ public:
   // Multiplexed
   int multiplex_value = 0;
   Signal *multiplexor = nullptr;
+
+  // Compiled by updateMsbLsb: the bytes holding the signal are loaded into one
+  // integer in signal order, then shifted and masked.
+  struct ExtractionPlan {
+    int first_byte = 0;
+    int num_bytes = 0;  // 0 if the signal spans more than 8 bytes
+    int shift = 0;
+    uint64_t mask = 0;
+    uint64_t sign_bit = 0;  // 0 for unsigned signals
+  } plan;
 };
 
 class Msg {
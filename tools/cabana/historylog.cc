@@ -1,5 +1,6 @@
 #include "tools/cabana/historylog.h"
 
+#include <cmath>
 #include <functional>
 
 #include <QFileDialog>
@@ -100,13 +101,18 @@ void HistoryLogModel::fetchData(std::deque<Message>::iterator insert_pos, uint64
     return ts > e->mono_time;
   });
 
+  // the shared series follow the order of the events
+  std::vector<std::shared_ptr<const SignalSeries>> series;
+  for (auto sig : sigs) series.push_back(can->series(msg_id, sig));
+
   std::vector<HistoryLogModel::Message> msgs;
   std::vector<double> values(sigs.size());
   msgs.reserve(batch_size);
   for (; first != events.rend() && (*first)->mono_time > min_time; ++first) {
-    const CanEvent *e = *first;
+    const CanEventRef e = *first;
+    const size_t idx = std::distance(first, events.rend()) - 1;
     for (int i = 0; i < sigs.size(); ++i) {
-      sigs[i]->getValue(e->dat, e->size, &values[i]);
+      if (double v = (*series[i])[idx].value; !std::isnan(v)) values[i] = v;
     }
     if (!filter_cmp || filter_cmp(values[filter_sig_idx], filter_value)) {
        msgs.emplace_back(Message{e->mono_time, values, {e->dat, e->dat + e->size}});
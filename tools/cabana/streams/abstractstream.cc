@@ -1,5 +1,6 @@
 #include "tools/cabana/streams/abstractstream.h"
 
+#include <tuple>
 #include <utility>
 
 #include <QApplication>
@@ -19,6 +20,9 @@ AbstractStream::AbstractStream(QObject *parent) : QObject(parent) {
   QObject::connect(this, &AbstractStream::seeking, this, [this](double sec) { current_sec_ = sec; });
   QObject::connect(dbc(), &DBCManager::DBCFileChanged, this, &AbstractStream::updateMasks);
   QObject::connect(dbc(), &DBCManager::maskUpdated, this, &AbstractStream::updateMasks);
+  QObject::connect(dbc(), &DBCManager::DBCFileChanged, this, [this]() { series_cache_.clear(); });
+  QObject::connect(dbc(), &DBCManager::signalRemoved, this, [this](const cabana::Signal *sig) { series_cache_.remove(sig); });
+  QObject::connect(dbc(), &DBCManager::msgRemoved, this, [this](MessageId id) { series_cache_.remove(id.address); });
 }
 
 void AbstractStream::updateMasks() {
@@ -114,12 +118,42 @@ void AbstractStream::updateEvent(const MessageId &id, double sec, const uint8_t
   new_msgs_.insert(id);
 }
 
-const std::vector<const CanEvent *> &AbstractStream::events(const MessageId &id) const {
-  static std::vector<const CanEvent *> empty_events;
+const MessageEvents &AbstractStream::events(const MessageId &id) const {
+  static MessageEvents empty_events;
   auto it = events_.find(id);
   return it != events_.end() ? it->second : empty_events;
 }
 
+void AbstractStream::forEachEvent(const std::function<void(const CanEventRef &)> &callback, uint64_t begin_ts, uint64_t end_ts) const {
+  // a cursor per message, the one with the earliest event on top of the heap
+  struct Cursor {
+    MessageEvents::const_iterator it, end;
+  };
+  std::vector<Cursor> cursors;
+  cursors.reserve(events_.size());
+  for (const auto &[_, ev] : events_) {
+    auto first = std::lower_bound(ev.begin(), ev.end(), begin_ts, CompareCanEvent());
+    auto last = std::lower_bound(first, ev.end(), end_ts, CompareCanEvent());
+    if (first != last) cursors.push_back({first, last});
+  }
+
+  auto later = [](const Cursor &l, const Cursor &r) {
+    const CanEventRef a = *l.it, b = *r.it;
+    return std::tie(a.mono_time, a.src, a.address) > std::tie(b.mono_time, b.src, b.address);
+  };
+  std::make_heap(cursors.begin(), cursors.end(), later);
+  while (!cursors.empty()) {
+    std::pop_heap(cursors.begin(), cursors.end(), later);
+    auto &cursor = cursors.back();
+    callback(*cursor.it);
+    if (++cursor.it == cursor.end) {
+      cursors.pop_back();
+    } else {
+      std::push_heap(cursors.begin(), cursors.end(), later);
+    }
+  }
+}
+
 const CanData &AbstractStream::lastMessage(const MessageId &id) const {
   static CanData empty_data = {};
   auto it = last_msgs.find(id);
@@ -186,17 +220,203 @@ void AbstractStream::mergeEvents(const std::vector<const CanEvent *> &events) {
   if (!events.empty()) {
     for (const auto &[id, new_e] : msg_events) {
       if (!new_e.empty()) {
-        auto &e = events_[id];
-        auto pos = std::upper_bound(e.cbegin(), e.cend(), new_e.front()->mono_time, CompareCanEvent());
-        e.insert(pos, new_e.cbegin(), new_e.cend());
+        events_[id].insert(new_e);
       }
     }
-    auto pos = std::upper_bound(all_events_.cbegin(), all_events_.cend(), events.front()->mono_time, CompareCanEvent());
-    all_events_.insert(pos, events.cbegin(), events.cend());
+    series_cache_.merge(msg_events);
+    // the events are copied into events_, release the staged ones
+    event_buffer_ = std::make_unique<MonotonicBuffer>(EVENT_NEXT_BUFFER_SIZE);
     emit eventsMerged(msg_events);
   }
 }
 
+// MessageEventBlock
+
+void MessageEventBlock::push_back(const CanEvent *e) {
+  if (size() == 0) {
+    src_ = e->src;
+    address_ = e->address;
+  }
+  if (e->size > stride_) {
+    setStride(e->size);
+  }
+  mono_times_.push_back(e->mono_time);
+  sizes_.push_back(e->size);
+  data_.resize(data_.size() + stride_);
+  std::copy_n(e->dat, e->size, data_.end() - stride_);
+}
+
+void MessageEventBlock::append(const MessageEventBlock &block) {
+  if (size() == 0) {
+    src_ = block.src_;
+    address_ = block.address_;
+  }
+  if (block.stride_ > stride_) {
+    setStride(block.stride_);
+  }
+  const size_t pos = size();
+  mono_times_.insert(mono_times_.end(), block.mono_times_.begin(), block.mono_times_.end());
+  sizes_.insert(sizes_.end(), block.sizes_.begin(), block.sizes_.end());
+  if (block.stride_ == stride_) {
+    data_.insert(data_.end(), block.data_.begin(), block.data_.end());
+  } else {
+    data_.resize(size() * stride_, 0);
+    for (size_t i = 0; i < block.size(); ++i) {
+      std::copy_n(block.data(i), block.sizes_[i], data_.begin() + (pos + i) * stride_);
+    }
+  }
+}
+
+MessageEventBlock MessageEventBlock::split(size_t i) {
+  MessageEventBlock tail;
+  tail.src_ = src_;
+  tail.address_ = address_;
+  tail.stride_ = stride_;
+  tail.mono_times_.assign(mono_times_.begin() + i, mono_times_.end());
+  tail.sizes_.assign(sizes_.begin() + i, sizes_.end());
+  tail.data_.assign(data_.begin() + i * stride_, data_.end());
+  mono_times_.resize(i);
+  sizes_.resize(i);
+  data_.resize(i * stride_);
+  return tail;
+}
+
+void MessageEventBlock::setStride(size_t stride) {
+  std::vector<uint8_t> data(size() * stride, 0);
+  for (size_t i = 0; i < size(); ++i) {
+    std::copy_n(data_.begin() + i * stride_, sizes_[i], data.begin() + i * stride);
+  }
+  data_ = std::move(data);
+  stride_ = stride;
+}
+
+// SeriesCache
+
+std::shared_ptr<const SignalSeries> SeriesCache::get(const MessageEvents &events, const MessageId &id, const cabana::Signal *sig) {
+  const Key key = {id, sig};
+  std::shared_ptr<Entry> entry;
+  {
+    std::lock_guard lk(lock_);
+    auto &e = entries_[key];
+    if (!e) e = std::make_shared<Entry>();
+    e->last_used = ++use_count_;
+    entry = e;
+  }
+
+  std::optional<size_t> decoded_size;
+  {
+    std::lock_guard lk(entry->lock);
+    if (!entry->decoded || !isCurrent(*entry, sig)) {
+      entry->sig = *sig;
+      entry->multiplexor.reset();
+      if (sig->multiplexor) {
+        entry->multiplexor = *sig->multiplexor;
+      }
+      entry->sig.multiplexor = entry->multiplexor ? &*entry->multiplexor : nullptr;
+      entry->series.clear();
+      decode(*entry, events, entry->series);
+      entry->decoded = true;
+      decoded_size = entry->series.size();
+    }
+  }
+
+  if (decoded_size) {
+    std::lock_guard lk(lock_);
+    if (auto it = entries_.find(key); it != entries_.end() && it->second == entry) {
+      total_values_ = total_values_ - entry->size + *decoded_size;
+      entry->size = *decoded_size;
+      evict(key);
+    }
+  }
+  // shares the ownership of the entry, so an evicted series outlives its last user
+  return std::shared_ptr<const SignalSeries>(entry, &entry->series);
+}
+
+void SeriesCache::merge(const MessageEventsMap &new_events) {
+  std::lock_guard lk(lock_);
+  for (auto &[key, entry] : entries_) {
+    auto it = new_events.find(key.first);
+    if (it == new_events.end() || it->second.empty()) continue;
+
+    std::lock_guard entry_lk(entry->lock);
+    if (!entry->decoded) continue;
+
+    decode(*entry, it->second, entry->series);
+    total_values_ += entry->series.size() - entry->size;
+    entry->size = entry->series.size();
+  }
+  evict({});
+}
+
+void SeriesCache::remove(const cabana::Signal *sig) {
+  std::lock_guard lk(lock_);
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    if (it->first.second == sig) {
+      total_values_ -= it->second->size;
+      it = entries_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void SeriesCache::remove(uint32_t address) {
+  std::lock_guard lk(lock_);
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    if (it->first.first.address == address) {
+      total_values_ -= it->second->size;
+      it = entries_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void SeriesCache::clear() {
+  std::lock_guard lk(lock_);
+  entries_.clear();
+  total_values_ = 0;
+}
+
+void SeriesCache::evict(const Key &keep) {
+  while (total_values_ > max_values_) {
+    auto lru = entries_.end();
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+      if (it->first != keep && it->second->size > 0 && (lru == entries_.end() || it->second->last_used < lru->second->last_used)) {
+        lru = it;
+      }
+    }
+    if (lru == entries_.end()) break;
+
+    total_values_ -= lru->second->size;
+    entries_.erase(lru);
+  }
+}
+
+bool SeriesCache::isCurrent(const Entry &entry, const cabana::Signal *sig) {
+  auto same_decoding = [](const cabana::Signal &a, const cabana::Signal &b) {
+    return a.start_bit == b.start_bit && a.size == b.size && a.is_signed == b.is_signed &&
+           a.is_little_endian == b.is_little_endian && a.factor == b.factor && a.offset == b.offset;
+  };
+  if (!same_decoding(entry.sig, *sig) || entry.multiplexor.has_value() != (sig->multiplexor != nullptr)) {
+    return false;
+  }
+  return !sig->multiplexor || (entry.sig.multiplex_value == sig->multiplex_value && same_decoding(*entry.multiplexor, *sig->multiplexor));
+}
+
+void SeriesCache::decode(const Entry &entry, const MessageEvents &events, SignalSeries &series) {
+  for (const auto &block : events.blocks()) {
+    SignalSeriesBlock decoded;
+    decoded.mono_times.reserve(block.size());
+    for (size_t i = 0; i < block.size(); ++i) {
+      decoded.mono_times.push_back(block.monoTime(i));
+    }
+    decoded.values.resize(block.size());
+    block.getValues(&entry.sig, decoded.values.data());
+    series.insert(std::move(decoded));
+  }
+}
+
 namespace {
 
 enum Color { GREYISH_BLUE, CYAN, RED};
@@ -2,10 +2,15 @@
 
 #include <algorithm>
 #include <array>
+#include <functional>
+#include <map>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <mutex>
 #include <optional>
 #include <set>
+#include <type_traits>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -39,6 +44,7 @@ struct CanData {
   double last_freq_update_ts = 0;
 };
 
+// An event as received, staged until it is merged into the MessageEvents of its message.
 struct CanEvent {
   uint8_t src;
   uint32_t address;
@@ -47,12 +53,257 @@ struct CanEvent {
   uint8_t dat[];
 };
 
+// A view of one event in MessageEvents. It has the fields of CanEvent and operator->,
+// so code written against `const CanEvent *` works with it unchanged.
+struct CanEventRef {
+  uint8_t src;
+  uint32_t address;
+  uint64_t mono_time;
+  uint8_t size;
+  const uint8_t *dat;
+  const CanEventRef *operator->() const { return this; }
+};
+
 struct CompareCanEvent {
   constexpr bool operator()(const CanEvent *const e, uint64_t ts) const { return e->mono_time < ts; }
   constexpr bool operator()(uint64_t ts, const CanEvent *const e) const { return ts < e->mono_time; }
+  constexpr bool operator()(const CanEventRef &e, uint64_t ts) const { return e.mono_time < ts; }
+  constexpr bool operator()(uint64_t ts, const CanEventRef &e) const { return ts < e.mono_time; }
+};
+
+// A run of one message's events in columns: the timestamps, the sizes, and the payloads
+// at a fixed stride (the largest size seen), so walking the history reads contiguous memory.
+class MessageEventBlock {
+public:
+  void push_back(const CanEvent *e);
+  void append(const MessageEventBlock &block);
+  // moves the events from index i on into a new block
+  MessageEventBlock split(size_t i);
+
+  inline size_t size() const { return mono_times_.size(); }
+  inline uint64_t monoTime(size_t i) const { return mono_times_[i]; }
+  inline size_t upperBound(uint64_t ts) const {
+    return std::upper_bound(mono_times_.begin(), mono_times_.end(), ts) - mono_times_.begin();
+  }
+  inline const uint8_t *data(size_t i) const { return data_.data() + i * stride_; }
+  inline const uint8_t *sizes() const { return sizes_.data(); }
+  inline size_t stride() const { return stride_; }
+  // decodes the signal from every event of the block
+  inline void getValues(const cabana::Signal *sig, double *vals) const { sig->getValues(data(0), stride_, sizes(), size(), vals); }
+  inline CanEventRef operator[](size_t i) const {
+    return {.src = src_, .address = address_, .mono_time = mono_times_[i], .size = sizes_[i], .dat = data(i)};
+  }
+
+private:
+  void setStride(size_t stride);
+
+  uint8_t src_ = 0;
+  uint32_t address_ = 0;
+  size_t stride_ = 0;
+  std::vector<uint64_t> mono_times_;
+  std::vector<uint8_t> sizes_;
+  std::vector<uint8_t> data_;
 };
 
-typedef std::unordered_map<MessageId, std::vector<const CanEvent *>> MessageEventsMap;
+// Events sorted by time, stored as a list of blocks. A batch newer than every event is appended
+// to the last block; a batch that lands in the middle (a segment loaded after a seek) is linked
+// in as its own block, splitting at most one block instead of shifting all the later events.
+template <typename Block>
+class SortedBlocks {
+public:
+  using value_type = std::decay_t<decltype(std::declval<const Block &>()[0])>;
+
+  class const_iterator {
+  public:
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = typename SortedBlocks::value_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = value_type;
+    using reference = value_type;
+
+    const_iterator(const SortedBlocks *list = nullptr, size_t i = 0) : list_(list), i_(i), block_(list ? list->blockOf(i) : 0) {}
+    reference operator*() const { return list_->blocks_[block_][i_ - list_->starts_[block_]]; }
+    pointer operator->() const { return **this; }
+    reference operator[](difference_type n) const { return (*list_)[i_ + n]; }
+    const_iterator &operator++() {
+      if (++i_, block_ + 1 < list_->starts_.size() && i_ >= list_->starts_[block_ + 1]) ++block_;
+      return *this;
+    }
+    const_iterator &operator--() {
+      if (--i_ < list_->starts_[block_]) --block_;
+      return *this;
+    }
+    const_iterator operator++(int) { auto it = *this; ++*this; return it; }
+    const_iterator operator--(int) { auto it = *this; --*this; return it; }
+    const_iterator &operator+=(difference_type n) { i_ += n; block_ = list_->blockOf(i_); return *this; }
+    const_iterator &operator-=(difference_type n) { return *this += -n; }
+    const_iterator operator+(difference_type n) const { return {list_, i_ + n}; }
+    const_iterator operator-(difference_type n) const { return {list_, i_ - n}; }
+    friend const_iterator operator+(difference_type n, const const_iterator &it) { return it + n; }
+    difference_type operator-(const const_iterator &other) const { return (difference_type)i_ - (difference_type)other.i_; }
+    bool operator==(const const_iterator &other) const { return i_ == other.i_; }
+    bool operator!=(const const_iterator &other) const { return i_ != other.i_; }
+    bool operator<(const const_iterator &other) const { return i_ < other.i_; }
+    bool operator>(const const_iterator &other) const { return i_ > other.i_; }
+    bool operator<=(const const_iterator &other) const { return i_ <= other.i_; }
+    bool operator>=(const const_iterator &other) const { return i_ >= other.i_; }
+
+  private:
+    const SortedBlocks *list_;
+    size_t i_;
+    size_t block_;
+  };
+  using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+  // e must not be older than the last event
+  void push_back(const CanEvent *e) {
+    if (blocks_.empty()) {
+      blocks_.emplace_back();
+      starts_.push_back(0);
+    }
+    blocks_.back().push_back(e);
+    ++size_;
+  }
+  // inserts a sorted batch after the events with the same or earlier time
+  void insert(Block block) {
+    if (block.size() == 0) return;
+
+    size_ += block.size();
+    const uint64_t ts = block.monoTime(0);
+    auto it = std::upper_bound(blocks_.begin(), blocks_.end(), ts, [](uint64_t ts, const Block &b) {
+      return ts < b.monoTime(b.size() - 1);
+    });
+    if (it == blocks_.end() && it != blocks_.begin()) {
+      std::prev(it)->append(block);
+    } else {
+      if (it != blocks_.end()) {
+        if (size_t i = it->upperBound(ts); i > 0) {
+          Block tail = it->split(i);
+          it = blocks_.insert(std::next(it), std::move(tail));
+        }
+      }
+      blocks_.insert(it, std::move(block));
+    }
+    starts_.resize(blocks_.size());
+    for (size_t i = 1; i < blocks_.size(); ++i) {
+      starts_[i] = starts_[i - 1] + blocks_[i - 1].size();
+    }
+  }
+  void insert(const SortedBlocks &events) {
+    for (const auto &block : events.blocks_) insert(block);
+  }
+  void clear() {
+    blocks_.clear();
+    starts_.clear();
+    size_ = 0;
+  }
+
+  inline size_t size() const { return size_; }
+  inline bool empty() const { return size_ == 0; }
+  inline const std::vector<Block> &blocks() const { return blocks_; }
+  inline value_type operator[](size_t i) const {
+    const size_t b = blockOf(i);
+    return blocks_[b][i - starts_[b]];
+  }
+  inline value_type front() const { return blocks_.front()[0]; }
+  inline value_type back() const { return blocks_.back()[blocks_.back().size() - 1]; }
+
+  inline const_iterator begin() const { return {this, 0}; }
+  inline const_iterator end() const { return {this, size_}; }
+  inline const_iterator cbegin() const { return begin(); }
+  inline const_iterator cend() const { return end(); }
+  inline const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+  inline const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+private:
+  // the block holding the event at index i, or the last block for the end index
+  inline size_t blockOf(size_t i) const {
+    return starts_.empty() ? 0 : std::upper_bound(starts_.begin(), starts_.end(), i) - starts_.begin() - 1;
+  }
+
+  std::vector<Block> blocks_;
+  std::vector<size_t> starts_;  // index of the first event of each block
+  size_t size_ = 0;
+};
+
+using MessageEvents = SortedBlocks<MessageEventBlock>;
+
+typedef std::unordered_map<MessageId, MessageEvents> MessageEventsMap;
+
+struct SeriesPoint {
+  uint64_t mono_time;
+  double value;
+};
+
+// A run of decoded values of a signal, in the same block layout as MessageEvents.
+struct SignalSeriesBlock {
+  void append(const SignalSeriesBlock &block) {
+    mono_times.insert(mono_times.end(), block.mono_times.begin(), block.mono_times.end());
+    values.insert(values.end(), block.values.begin(), block.values.end());
+  }
+  SignalSeriesBlock split(size_t i) {
+    SignalSeriesBlock tail{{mono_times.begin() + i, mono_times.end()}, {values.begin() + i, values.end()}};
+    mono_times.resize(i);
+    values.resize(i);
+    return tail;
+  }
+  inline size_t size() const { return mono_times.size(); }
+  inline uint64_t monoTime(size_t i) const { return mono_times[i]; }
+  inline size_t upperBound(uint64_t ts) const {
+    return std::upper_bound(mono_times.begin(), mono_times.end(), ts) - mono_times.begin();
+  }
+  inline SeriesPoint operator[](size_t i) const { return {mono_times[i], values[i]}; }
+
+  std::vector<uint64_t> mono_times;
+  std::vector<double> values;
+};
+
+// The decoded values of a signal in the order of its message's events.
+// Events that carry another multiplex value are NaN.
+using SignalSeries = SortedBlocks<SignalSeriesBlock>;
+
+// Decoded series shared by charts, the history log and export, so each signal is decoded once.
+// Merged events are decoded into the cached series, and a series whose signal has been edited since it
+// was decoded is decoded again on its next use. When the series hold more than max_values values,
+// the least recently used ones are dropped.
+class SeriesCache {
+public:
+  static constexpr size_t DEFAULT_MAX_VALUES = 16 * 1024 * 1024;
+  SeriesCache(size_t max_values = DEFAULT_MAX_VALUES) : max_values_(max_values) {}
+
+  // The series stays alive while it is held, and is up to date until the next merge or DBC edit.
+  std::shared_ptr<const SignalSeries> get(const MessageEvents &events, const MessageId &id, const cabana::Signal *sig);
+  void merge(const MessageEventsMap &new_events);
+  // drop the series of removed signals and messages
+  void remove(const cabana::Signal *sig);
+  void remove(uint32_t address);
+  void clear();
+
+private:
+  struct Entry {
+    std::mutex lock;
+    bool decoded = false;
+    // copies of the signal and its multiplexor as they were decoded
+    cabana::Signal sig;
+    std::optional<cabana::Signal> multiplexor;
+    SignalSeries series;
+    // guarded by lock_
+    uint64_t last_used = 0;
+    size_t size = 0;
+  };
+  using Key = std::pair<MessageId, const cabana::Signal *>;
+  // drops the least recently used series until the rest fit in max_values_, lock_ must be held
+  void evict(const Key &keep);
+  static bool isCurrent(const Entry &entry, const cabana::Signal *sig);
+  // decodes the events into the series, at the same position MessageEvents inserts them
+  static void decode(const Entry &entry, const MessageEvents &events, SignalSeries &series);
+
+  const size_t max_values_;
+  std::mutex lock_;
+  std::map<Key, std::shared_ptr<Entry>> entries_;
+  uint64_t use_count_ = 0;
+  size_t total_values_ = 0;
+};
 
 class AbstractStream : public QObject {
   Q_OBJECT
@@ -82,9 +333,14 @@ public:
 
   inline const std::unordered_map<MessageId, CanData> &lastMessages() const { return last_msgs; }
   inline const MessageEventsMap &eventsMap() const { return events_; }
-  inline const std::vector<const CanEvent *> &allEvents() const { return all_events_; }
   const CanData &lastMessage(const MessageId &id) const;
-  const std::vector<const CanEvent *> &events(const MessageId &id) const;
+  const MessageEvents &events(const MessageId &id) const;
+  // visits the events of all messages with begin_ts <= mono_time < end_ts in time order,
+  // merged from the events of each message, so there is no second copy of them
+  void forEachEvent(const std::function<void(const CanEventRef &)> &callback, uint64_t begin_ts = 0,
+                    uint64_t end_ts = std::numeric_limits<uint64_t>::max()) const;
+  // the decoded values of sig in the events of id, shared by all views
+  inline std::shared_ptr<const SignalSeries> series(const MessageId &id, const cabana::Signal *sig) { return series_cache_.get(events(id), id, sig); }
 
   size_t suppressHighlighted();
   void clearSuppressed();
@@ -105,11 +361,11 @@ public:
   SourceSet sources;
 
 protected:
+  // the events must come from newEvent(), they are released once merged
   void mergeEvents(const std::vector<const CanEvent *> &events);
   const CanEvent *newEvent(uint64_t mono_time, const cereal::CanData::Reader &c);
   void updateEvent(const MessageId &id, double sec, const uint8_t *data, uint8_t size);
 
-  std::vector<const CanEvent *> all_events_;
   double current_sec_ = 0;
   std::optional<std::pair<double, double>> time_range_;
 
@@ -119,6 +375,7 @@ private:
   void updateMasks();
 
   MessageEventsMap events_;
+  SeriesCache series_cache_;
   std::unordered_map<MessageId, CanData> last_msgs;
   std::unique_ptr<MonotonicBuffer> event_buffer_;
 
@@ -90,13 +90,14 @@ void LiveStream::timerEvent(QTimerEvent *event) {
     {
       // merge events received from live stream thread.
       std::lock_guard lk(lock);
+      if (!received_events_.empty()) {
+        if (lastest_event_ts == 0) begin_event_ts = received_events_.front()->mono_time;
+        lastest_event_ts = std::max(lastest_event_ts, received_events_.back()->mono_time);
+      }
       mergeEvents(received_events_);
-      uint64_t last_received_ts = !received_events_.empty() ? received_events_.back()->mono_time : 0;
-      lastest_event_ts = std::max(lastest_event_ts, last_received_ts);
       received_events_.clear();
     }
-    if (!all_events_.empty()) {
-      begin_event_ts = all_events_.front()->mono_time;
+    if (lastest_event_ts != 0) {
       updateEvents();
       return;
     }
@@ -109,7 +110,7 @@ void LiveStream::updateEvents() {
 
   if (first_update_ts == 0) {
     first_update_ts = nanos_since_boot();
-    first_event_ts = current_event_ts = all_events_.back()->mono_time;
+    first_event_ts = current_event_ts = lastest_event_ts;
   }
 
   if (paused_ || prev_speed != speed_) {
@@ -120,17 +121,14 @@ void LiveStream::updateEvents() {
   }
 
   uint64_t last_ts = post_last_event && speed_ == 1.0
-                       ? all_events_.back()->mono_time
+                       ? lastest_event_ts
                        : first_event_ts + (nanos_since_boot() - first_update_ts) * speed_;
-  auto first = std::upper_bound(all_events_.cbegin(), all_events_.cend(), current_event_ts, CompareCanEvent());
-  auto last = std::upper_bound(first, all_events_.cend(), last_ts, CompareCanEvent());
-
-  for (auto it = first; it != last; ++it) {
-    const CanEvent *e = *it;
-    MessageId id = {.source = e->src, .address = e->address};
-    updateEvent(id, (e->mono_time - begin_event_ts) / 1e9, e->dat, e->size);
-    current_event_ts = e->mono_time;
-  }
+  // the events after current_event_ts, up to and including last_ts
+  forEachEvent([this](const CanEventRef &e) {
+    MessageId id = {.source = e.src, .address = e.address};
+    updateEvent(id, (e.mono_time - begin_event_ts) / 1e9, e.dat, e.size);
+    current_event_ts = e.mono_time;
+  }, current_event_ts + 1, last_ts + 1);
   emit privateUpdateLastMsgsSignal();
 }
 
@@ -32,10 +32,12 @@ void ReplayStream::mergeSegments() {
     if (seg && seg->isLoaded() && !processed_segments.count(n)) {
       processed_segments.insert(n);
 
+      const auto &events = seg->log->events;
       std::vector<const CanEvent *> new_events;
-      new_events.reserve(seg->log->events.size());
-      for (const Event &e : seg->log->events) {
-        if (e.which == cereal::Event::Which::CAN) {
+      new_events.reserve(events.size());
+      for (size_t i = 0; i < events.size(); ++i) {
+        if (events.which(i) == cereal::Event::Which::CAN) {
+          const Event e = events[i];
           capnp::FlatArrayMessageReader reader(e.data);
           auto event = reader.getRoot<cereal::Event>();
           for (const auto &c : event.getCan()) {
@@ -1,9 +1,13 @@
 
 #undef INFO
+#include <cmath>
+#include <limits>
+#include <tuple>
 #include <QDir>
 
 #include "catch2/catch.hpp"
 #include "tools/cabana/dbc/dbcmanager.h"
+#include "tools/cabana/streams/abstractstream.h"
 
 const std::string TEST_RLOG_URL = "https://commadataci.blob.core.windows.net/openpilotci/0c94aa1e1296d7c6/2021-05-05--19-48-37/0/rlog.bz2";
 
@@ -155,3 +159,253 @@ TEST_CASE("parse_opendbc") {
   INFO(errors.join("\n").toStdString());
   REQUIRE(errors.empty());
 }
+
+TEST_CASE("MessageEvents") {
+  MonotonicBuffer buffer(1024);
+  auto new_event = [&buffer](uint64_t mono_time, uint8_t size, uint8_t value) {
+    CanEvent *e = (CanEvent *)buffer.allocate(sizeof(CanEvent) + size);
+    *e = {.src = 1, .address = 0x123, .mono_time = mono_time, .size = size};
+    memset(e->dat, value, size);
+    return e;
+  };
+
+  MessageEvents events, new_events;
+  for (int i = 0; i < 5; ++i) {
+    events.push_back(new_event(i * 10, 4, i));
+  }
+  // a larger payload widens the stride of the existing events
+  new_events.push_back(new_event(25, 8, 0xff));
+  events.insert(new_events);
+
+  REQUIRE(events.size() == 6);
+  const uint64_t expected_times[] = {0, 10, 20, 25, 30, 40};
+  for (int i = 0; i < events.size(); ++i) {
+    auto e = events[i];
+    REQUIRE(e.mono_time == expected_times[i]);
+    REQUIRE(e.src == 1);
+    REQUIRE(e.address == 0x123);
+    REQUIRE(e.size == (e.mono_time == 25 ? 8 : 4));
+    REQUIRE(std::all_of(e.dat, e.dat + e.size, [&](uint8_t v) { return v == (e.mono_time == 25 ? 0xff : e.mono_time / 10); }));
+  }
+
+  auto it = std::upper_bound(events.begin(), events.end(), 25, CompareCanEvent());
+  REQUIRE(it - events.begin() == 4);
+  REQUIRE(it->mono_time == 30);
+  REQUIRE((*std::prev(it))->mono_time == 25);
+  REQUIRE(events.rbegin()->mono_time == 40);
+}
+
+TEST_CASE("SortedBlocks merges segments out of order") {
+  MonotonicBuffer buffer(64 * 1024);
+  std::vector<const CanEvent *> segments[4];
+  for (int n = 0; n < std::size(segments); ++n) {
+    for (int i = 0; i < 100; ++i) {
+      CanEvent *e = (CanEvent *)buffer.allocate(sizeof(CanEvent) + 8);
+      *e = {.src = 0, .address = 0x100, .mono_time = uint64_t(n * 1000 + i * 10), .size = 8};
+      memset(e->dat, n, 8);
+      segments[n].push_back(e);
+    }
+  }
+
+  // as after a seek: segment 3 is appended to the block of segment 0, then segment 2 splits it
+  MessageEvents events;
+  for (int n : {0, 3, 2, 1}) {
+    MessageEvents batch;
+    for (auto e : segments[n]) batch.push_back(e);
+    events.insert(batch);
+  }
+  REQUIRE(events.size() == 400);
+  REQUIRE(events.blocks().size() == 4);
+  REQUIRE(std::is_sorted(events.begin(), events.end(), [](auto l, auto r) { return l.mono_time < r.mono_time; }));
+  for (int i = 0; i < 400; ++i) {
+    REQUIRE(events[i].mono_time == segments[i / 100][i % 100]->mono_time);
+    REQUIRE(events[i].dat[7] == i / 100);
+  }
+  auto it = std::lower_bound(events.begin(), events.end(), 2000, CompareCanEvent());
+  REQUIRE(it - events.begin() == 200);
+  REQUIRE(std::prev(it)->mono_time == 1990);
+  REQUIRE(std::next(events.rbegin(), 100)->mono_time == 2990);
+}
+
+TEST_CASE("Signal extraction plan") {
+  // reads the signal one bit at a time, msb first, following the DBC bit order
+  auto reference_value = [](const uint8_t *data, const cabana::Signal &s) {
+    uint64_t val = 0;
+    int pos = s.is_little_endian ? s.msb : s.start_bit;
+    for (int i = 0; i < s.size; ++i) {
+      val = (val << 1) | ((data[pos / 8] >> (pos % 8)) & 1);
+      if (s.is_little_endian) --pos;
+      else pos = pos % 8 == 0 ? pos + 15 : pos - 1;
+    }
+    if (s.is_signed && s.size < 64 && (val >> (s.size - 1)) & 1) val -= 1ULL << s.size;
+    return (int64_t)val * s.factor + s.offset;
+  };
+
+  uint8_t data[64];
+  for (int i = 0; i < std::size(data); ++i) data[i] = (i * 73 + 41) & 0xff;
+
+  cabana::Signal s;
+  s.factor = 0.5;
+  s.offset = -10;
+  for (bool little_endian : {true, false}) {
+    for (bool is_signed : {true, false}) {
+      for (int size = 1; size <= 64; ++size) {
+        for (int start_bit = 0; start_bit < 64 * 8; ++start_bit) {
+          s.is_little_endian = little_endian;
+          s.is_signed = is_signed;
+          s.size = size;
+          s.start_bit = start_bit;
+          updateMsbLsb(s);
+          if (s.lsb < 0 || s.msb >= 64 * 8 || s.lsb >= 64 * 8) continue;
+
+          INFO("start_bit " << start_bit << " size " << size << " little_endian " << little_endian << " signed " << is_signed);
+          REQUIRE(get_raw_value(data, std::size(data), s) == reference_value(data, s));
+        }
+      }
+    }
+  }
+}
+
+TEST_CASE("Signal::getValues") {
+  // two events of 8 bytes stored at a stride of 8
+  const uint8_t data[] = {0x01, 0x34, 0x12, 0, 0, 0, 0, 0,
+                          0x02, 0x78, 0x56, 0, 0, 0, 0, 0};
+  const uint8_t sizes[] = {8, 8};
+
+  cabana::Signal mux;
+  mux.start_bit = 0;
+  mux.size = 8;
+  mux.is_little_endian = true;
+  mux.is_signed = false;
+  updateMsbLsb(mux);
+
+  cabana::Signal sig;
+  sig.start_bit = 8;
+  sig.size = 16;
+  sig.is_little_endian = true;
+  sig.is_signed = false;
+  sig.factor = 2;
+  updateMsbLsb(sig);
+
+  double vals[2];
+  sig.getValues(data, 8, sizes, 2, vals);
+  REQUIRE(vals[0] == 0x1234 * 2);
+  REQUIRE(vals[1] == 0x5678 * 2);
+
+  sig.multiplexor = &mux;
+  sig.multiplex_value = 2;
+  sig.getValues(data, 8, sizes, 2, vals);
+  REQUIRE(std::isnan(vals[0]));
+  REQUIRE(vals[1] == 0x5678 * 2);
+}
+
+TEST_CASE("SeriesCache") {
+  MonotonicBuffer buffer(64 * 1024);
+  const MessageId id = {.source = 0, .address = 0x100};
+  auto new_batch = [&](int segment) {
+    MessageEvents batch;
+    for (int i = 0; i < 100; ++i) {
+      CanEvent *e = (CanEvent *)buffer.allocate(sizeof(CanEvent) + 8);
+      *e = {.src = 0, .address = 0x100, .mono_time = uint64_t(segment * 1000 + i * 10), .size = 8};
+      memset(e->dat, 0, 8);
+      e->dat[0] = i;
+      e->dat[1] = segment;
+      batch.push_back(e);
+    }
+    return batch;
+  };
+
+  cabana::Signal sig;
+  sig.start_bit = 0;
+  sig.size = 16;
+  sig.is_little_endian = true;
+  sig.is_signed = false;
+  updateMsbLsb(sig);
+
+  MessageEvents events;
+  events.insert(new_batch(0));
+  events.insert(new_batch(2));
+
+  SeriesCache cache;
+  auto series = cache.get(events, id, &sig);
+  REQUIRE(series->size() == 200);
+  REQUIRE((*series)[150].value == 0x0200 + 50);
+
+  // merged events are decoded into the cached series at the position of the events
+  MessageEventsMap new_events;
+  new_events[id] = new_batch(1);
+  events.insert(new_events[id]);
+  cache.merge(new_events);
+  REQUIRE(cache.get(events, id, &sig) == series);
+  REQUIRE(series->size() == events.size());
+  REQUIRE(series->blocks().size() == events.blocks().size());
+  for (int i = 0; i < events.size(); ++i) {
+    REQUIRE((*series)[i].mono_time == events[i].mono_time);
+    REQUIRE((*series)[i].value == (i / 100) * 0x100 + i % 100);
+  }
+
+  // an edited signal is decoded again
+  sig.factor = 2;
+  series = cache.get(events, id, &sig);
+  REQUIRE((*series)[150].value == (0x0100 + 50) * 2);
+
+  SECTION("least recently used series are dropped") {
+    SeriesCache small_cache(events.size() * 2);
+    cabana::Signal sigs[3] = {sig, sig, sig};
+    auto first = small_cache.get(events, id, &sigs[0]);
+    REQUIRE(small_cache.get(events, id, &sigs[1]) != nullptr);
+    REQUIRE(small_cache.get(events, id, &sigs[0]) == first);
+    // the series of sigs[1] is the least recently used
+    auto third = small_cache.get(events, id, &sigs[2]);
+    REQUIRE(small_cache.get(events, id, &sigs[0]) == first);
+    REQUIRE(small_cache.get(events, id, &sigs[2]) == third);
+
+    // a dropped series stays valid while it is held
+    auto second = small_cache.get(events, id, &sigs[1]);
+    REQUIRE(small_cache.get(events, id, &sigs[0]) != first);
+    REQUIRE(first->size() == events.size());
+    REQUIRE((*first)[150].value == (0x0100 + 50) * 2);
+  }
+}
+
+TEST_CASE("M4Pyramid") {
+  // the extremes of the points inside [min_x, max_x]
+  auto visible_minmax = [](const std::vector<QPointF> &v, double min_x, double max_x) {
+    double min = std::numeric_limits<double>::max(), max = std::numeric_limits<double>::lowest();
+    for (auto &p : v) {
+      if (p.x() >= min_x && p.x() <= max_x) {
+        min = std::min(min, p.y());
+        max = std::max(max, p.y());
+      }
+    }
+    return std::make_pair(min, max);
+  };
+
+  std::vector<QPointF> points;
+  for (int i = 0; i < 100000; ++i) {
+    points.emplace_back(i * 0.01, std::sin(i * 0.001) * 10 + (i * 7919 % 1000) / 100.0);
+  }
+  M4Pyramid lod;
+  lod.build(points);
+
+  for (auto [min_x, max_x, width] : {std::tuple{0.0, 1000.0, 800}, {300.0, 400.0, 500}, {500.0, 501.0, 100}, {123.4567, 876.5432, 700}}) {
+    auto decimated = lod.decimate(points, min_x, max_x, width);
+    REQUIRE(decimated.size() <= (size_t)width * 4 + 8);
+    REQUIRE(std::is_sorted(decimated.begin(), decimated.end(), [](auto &l, auto &r) { return l.x() < r.x(); }));
+    REQUIRE(visible_minmax(decimated, min_x, max_x) == visible_minmax(points, min_x, max_x));
+  }
+
+  // on a ramp the visible extremes are the first and last visible points, inside the buckets of the
+  // coarse levels that straddle the edges of the plot
+  std::vector<QPointF> ramp;
+  for (int i = 0; i < 100000; ++i) {
+    ramp.emplace_back(i * 0.01, i);
+  }
+  lod.build(ramp);
+  for (auto [min_x, max_x, width] : {std::tuple{123.4567, 876.5432, 800}, {0.1234, 999.9876, 300}, {250.005, 260.995, 10}}) {
+    auto decimated = lod.decimate(ramp, min_x, max_x, width);
+    REQUIRE(decimated.size() <= (size_t)width * 4 + 8);
+    REQUIRE(std::is_sorted(decimated.begin(), decimated.end(), [](auto &l, auto &r) { return l.x() < r.x(); }));
+    REQUIRE(visible_minmax(decimated, min_x, max_x) == visible_minmax(ramp, min_x, max_x));
+  }
+}
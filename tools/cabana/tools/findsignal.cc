@@ -43,7 +43,7 @@ void FindSignalModel::search(std::function<bool(double)> cmp) {
       last = std::upper_bound(events.cbegin(), events.cend(), last_time, CompareCanEvent());
     }
 
-    auto it = std::find_if(first, last, [&](const CanEvent *e) { return cmp(get_raw_value(e->dat, e->size, s.sig)); });
+    auto it = std::find_if(first, last, [&](const CanEventRef &e) { return cmp(get_raw_value(e.dat, e.size, s.sig)); });
     if (it != last) {
       auto values = s.values;
       values += QString("(%1, %2)").arg(can->toSeconds((*it)->mono_time), 0, 'f', 3).arg(get_raw_value((*it)->dat, (*it)->size, s.sig));
@@ -118,9 +118,8 @@ QList<FindSimilarBitsDlg::mismatched_struct> FindSimilarBitsDlg::calcBits(uint8_
                                                                           int bit_idx, uint8_t find_bus, bool equal, int min_msgs_cnt) {
   QHash<uint32_t, QVector<uint32_t>> mismatches;
   QHash<uint32_t, uint32_t> msg_count;
-  const auto &events = can->allEvents();
   int bit_to_find = -1;
-  for (const CanEvent *e : events) {
+  can->forEachEvent([&](const CanEventRef &e) {
     if (e->src == bus) {
       if (e->address == selected_address && e->size > byte_idx) {
         bit_to_find = ((e->dat[byte_idx] >> (7 - bit_idx)) & 1) != 0;
@@ -128,7 +127,7 @@ QList<FindSimilarBitsDlg::mismatched_struct> FindSimilarBitsDlg::calcBits(uint8_
     }
     if (e->src == find_bus) {
       ++msg_count[e->address];
-      if (bit_to_find == -1) continue;
+      if (bit_to_find == -1) return;
 
       auto &mismatched = mismatches[e->address];
       if (mismatched.size() < e->size * 8) {
@@ -141,7 +140,7 @@ QList<FindSimilarBitsDlg::mismatched_struct> FindSimilarBitsDlg::calcBits(uint8_
         }
       }
     }
-  }
+  });
 
   QList<mismatched_struct> result;
   result.reserve(mismatches.size());
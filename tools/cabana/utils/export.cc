@@ -1,5 +1,7 @@
 #include "tools/cabana/utils/export.h"
 
+#include <cmath>
+
 #include <QFile>
 #include <QTextStream>
 
@@ -12,10 +14,15 @@ void exportToCSV(const QString &file_name, std::optional<MessageId> msg_id) {
   if (file.open(QIODevice::ReadWrite | QIODevice::Truncate)) {
     QTextStream stream(&file);
     stream << "time,addr,bus,data\n";
-    for (auto e : msg_id ? can->events(*msg_id) : can->allEvents()) {
+    auto write_event = [&stream](const auto &e) {
       stream << QString::number(can->toSeconds(e->mono_time), 'f', 3) << ","
              << "0x" << QString::number(e->address, 16) << "," << e->src << ","
              << "0x" << QByteArray::fromRawData((const char *)e->dat, e->size).toHex().toUpper() << "\n";
+    };
+    if (msg_id) {
+      for (auto e : can->events(*msg_id)) write_event(e);
+    } else {
+      can->forEachEvent(write_event);
     }
   }
 }
@@ -29,15 +36,20 @@ void exportSignalsToCSV(const QString &file_name, const MessageId &msg_id) {
       stream << "," << s->name;
     stream << "\n";
 
+    // the shared series follow the order of the events
+    std::vector<std::shared_ptr<const SignalSeries>> series;
+    for (auto s : msg->sigs) series.push_back(can->series(msg_id, s));
+
+    size_t idx = 0;
     for (auto e : can->events(msg_id)) {
       stream << QString::number(can->toSeconds(e->mono_time), 'f', 3) << ","
              << "0x" << QString::number(e->address, 16) << "," << e->src;
-      for (auto s : msg->sigs) {
-        double value = 0;
-        s->getValue(e->dat, e->size, &value);
-        stream << "," << QString::number(value, 'f', s->precision);
+      for (int i = 0; i < msg->sigs.size(); ++i) {
+        const double value = (*series[i])[idx].value;
+        stream << "," << QString::number(std::isnan(value) ? 0 : value, 'f', msg->sigs[i]->precision);
       }
       stream << "\n";
+      ++idx;
     }
   }
 }
@@ -49,6 +49,110 @@ std::pair<double, double> SegmentTree::get_minmax(int n, int left, int right, in
   return {std::min(l.first, r.first), std::max(l.second, r.second)};
 }
 
+// M4Pyramid
+
+static const int M4_BUCKET_SIZE = 16;
+
+void M4Pyramid::build(const std::vector<QPointF> &points) {
+  levels.clear();
+  const std::vector<QPointF> *prev = &points;
+  while (prev->size() > M4_BUCKET_SIZE * 4) {
+    Level level;
+    level.points.reserve(prev->size() / M4_BUCKET_SIZE * 4 + 4);
+    level.bucket_starts.reserve(prev->size() / M4_BUCKET_SIZE + 1);
+    for (size_t i = 0; i < prev->size(); i += M4_BUCKET_SIZE) {
+      level.bucket_starts.push_back(level.points.size());
+      reduce(prev->data() + i, prev->data() + std::min(i + M4_BUCKET_SIZE, prev->size()), level.points);
+    }
+    levels.push_back(std::move(level));
+    prev = &levels.back().points;
+  }
+}
+
+// the visible points plus one on each side, so lines run to the edges of the plot
+static std::pair<std::vector<QPointF>::const_iterator, std::vector<QPointF>::const_iterator>
+visibleRange(const std::vector<QPointF> &v, double min_x, double max_x) {
+  auto first = std::lower_bound(v.begin(), v.end(), min_x, [](auto &p, double x) { return p.x() < x; });
+  auto last = std::upper_bound(first, v.end(), max_x, [](double x, auto &p) { return x < p.x(); });
+  return {first == v.begin() ? first : std::prev(first), last == v.end() ? last : std::next(last)};
+}
+
+std::vector<QPointF> M4Pyramid::decimate(const std::vector<QPointF> &points, double min_x, double max_x, int width) const {
+  const int max_points = std::max(width, 1) * 4;
+  auto [first, last] = visibleRange(points, min_x, max_x);
+  if (std::distance(first, last) <= max_points || max_x <= min_x) {
+    return std::vector<QPointF>(first, last);
+  }
+
+  // the coarsest level that still has four points per pixel column; its buckets are at most a column wide.
+  std::vector<QPointF> level_points;
+  for (auto it = levels.rbegin(); it != levels.rend(); ++it) {
+    auto range = visibleRange(it->points, min_x, max_x);
+    if (std::distance(range.first, range.second) >= max_points) {
+      level_points = withEdgePoints(points, *it, min_x, max_x);
+      first = level_points.cbegin();
+      last = level_points.cend();
+      break;
+    }
+  }
+
+  std::vector<QPointF> out;
+  out.reserve(max_points + 8);
+  const double pixels_per_x = width / (max_x - min_x);
+  while (first != last) {
+    const auto column = std::floor((first->x() - min_x) * pixels_per_x);
+    auto end = std::next(first);
+    while (end != last && std::floor((end->x() - min_x) * pixels_per_x) == column) ++end;
+    reduce(&*first, &*first + std::distance(first, end), out);
+    first = end;
+  }
+  return out;
+}
+
+std::vector<QPointF> M4Pyramid::withEdgePoints(const std::vector<QPointF> &points, const Level &level, double min_x, double max_x) {
+  auto [raw_first, raw_last] = visibleRange(points, min_x, max_x);
+  auto [first, last] = visibleRange(level.points, min_x, max_x);
+  size_t begin = first - level.points.begin(), end = last - level.points.begin();
+  auto bucket_of = [&](size_t i) {
+    return std::upper_bound(level.bucket_starts.begin(), level.bucket_starts.end(), i) - level.bucket_starts.begin() - 1;
+  };
+  auto bucket_end = [&](size_t b) { return b + 1 < level.bucket_starts.size() ? level.bucket_starts[b + 1] : level.points.size(); };
+
+  std::vector<QPointF> out;
+  // the point before min_x is followed by more points of its bucket
+  if (level.points[begin].x() < min_x && begin + 1 < bucket_end(bucket_of(begin))) {
+    const double last_x = level.points[bucket_end(bucket_of(begin)) - 1].x();
+    auto it = std::upper_bound(raw_first, raw_last, last_x, [](double x, auto &p) { return x < p.x(); });
+    out.insert(out.end(), raw_first, it);
+    begin = bucket_end(bucket_of(begin));
+  }
+  // the point after max_x is preceded by more points of its bucket
+  size_t right = end;
+  if (end > begin && level.points[end - 1].x() > max_x) {
+    const size_t start = level.bucket_starts[bucket_of(end - 1)];
+    if (start >= begin && start < end - 1) right = start;
+  }
+  if (begin < right) {
+    out.insert(out.end(), level.points.begin() + begin, level.points.begin() + right);
+  }
+  if (right < end) {
+    const double first_x = level.points[right].x();
+    auto it = std::lower_bound(raw_first, raw_last, first_x, [](auto &p, double x) { return p.x() < x; });
+    out.insert(out.end(), it, raw_last);
+  }
+  return out;
+}
+
+void M4Pyramid::reduce(const QPointF *first, const QPointF *last, std::vector<QPointF> &out) {
+  auto [min, max] = std::minmax_element(first, last, [](auto &l, auto &r) { return l.y() < r.y(); });
+  if (min > max) std::swap(min, max);
+  // in x order, without repeating a point
+  out.push_back(*first);
+  if (min != first) out.push_back(*min);
+  if (max != min && max != first) out.push_back(*max);
+  if (last - 1 != max && last - 1 != first) out.push_back(*(last - 1));
+}
+
 // MessageBytesDelegate
 
 MessageBytesDelegate::MessageBytesDelegate(QObject *parent, bool multiple_lines)
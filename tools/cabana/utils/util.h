@@ -65,6 +65,29 @@ private:
   int size = 0;
 };
 
+// Min/max (M4) decimation for drawing: the first, min, max and last point of each pixel column.
+// Each level of the pyramid keeps the M4 points of buckets of the level below, so a wide range
+// is decimated from a coarse level instead of from every point. The buckets cut by the edges of
+// the plot are decimated from their points, as their M4 points may all lie outside of it.
+class M4Pyramid {
+public:
+  M4Pyramid() = default;
+  void build(const std::vector<QPointF> &points);
+  inline void clear() { levels.clear(); }
+  // points must be the vector the pyramid was built from, or any vector if it is empty
+  std::vector<QPointF> decimate(const std::vector<QPointF> &points, double min_x, double max_x, int width) const;
+
+private:
+  struct Level {
+    std::vector<QPointF> points;
+    std::vector<size_t> bucket_starts;  // index of the first point of each bucket
+  };
+  static void reduce(const QPointF *first, const QPointF *last, std::vector<QPointF> &out);
+  // the visible points of the level, with the buckets that straddle min_x or max_x replaced by their points
+  static std::vector<QPointF> withEdgePoints(const std::vector<QPointF> &points, const Level &level, double min_x, double max_x);
+  std::vector<Level> levels;
+};
+
 class MessageBytesDelegate : public QStyledItemDelegate {
   Q_OBJECT
 public:
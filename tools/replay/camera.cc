@@ -3,10 +3,17 @@
 #include <capnp/dynamic.h>
 #include <cassert>
 
+#include "common/timing.h"
 #include "third_party/linux/include/msm_media_info.h"
 #include "tools/replay/util.h"
 
 const int BUFFER_COUNT = 40;
+// frames decoded ahead of the stream while the camera is idle, about one GOP.
+// must stay well below BUFFER_COUNT, so that frames decoded ahead aren't overwritten before they are sent.
+const int DECODE_AHEAD_FRAMES = 20;
+// frames of a camera waiting to be sent before pushFrame blocks. keeps the frames close to the
+// other messages when decoding falls behind, without serializing the cameras.
+const int MAX_IN_FLIGHT_FRAMES = 2;
 
 std::tuple<size_t, size_t, size_t> get_nv12_info(int width, int height) {
   int nv12_width = VENUS_Y_STRIDE(COLOR_FMT_NV12, width);
@@ -28,9 +35,9 @@ CameraServer::~CameraServer() {
   for (auto &cam : cameras_) {
     if (cam.thread.joinable()) {
       // Clear the queue
-      std::pair<FrameReader*, const Event *> item;
+      QueuedFrame item;
       while (cam.queue.try_pop(item)) {
-        --publishing_;
+        frameSent(cam);
       }
 
       // Signal termination and join the thread
@@ -44,7 +51,7 @@ CameraServer::~CameraServer() {
 void CameraServer::startVipcServer() {
   vipc_server_.reset(new VisionIpcServer("camerad"));
   for (auto &cam : cameras_) {
-    cam.cached_buf.clear();
+    clearCache(cam);
 
     if (cam.width > 0 && cam.height > 0) {
       rInfo("camera[%d] frame size %dx%d", cam.type, cam.width, cam.height);
@@ -61,63 +68,145 @@ void CameraServer::startVipcServer() {
 
 void CameraServer::cameraThread(Camera &cam) {
   while (true) {
-    const auto [fr, event] = cam.queue.pop();
+    // decode ahead while there are no frames to send
+    QueuedFrame item;
+    while (!cam.queue.try_pop(item)) {
+      bool decoded = false;
+      {
+        std::lock_guard lk(cam.mutex);
+        decoded = decodeAhead(cam);
+      }
+      if (!decoded) {
+        item = cam.queue.pop();
+        break;
+      }
+    }
+    const auto &[fr, data, push_time] = item;
     if (!fr) break;
 
-    capnp::FlatArrayMessageReader reader(event->data);
+    std::lock_guard lk(cam.mutex);
+
+    capnp::FlatArrayMessageReader reader(data);
     auto evt = reader.getRoot<cereal::Event>();
     auto eidx = capnp::AnyStruct::Reader(evt).getPointerSection()[0].getAs<cereal::EncodeIndex>();
 
     int segment_id = eidx.getSegmentId();
     uint32_t frame_id = eidx.getFrameId();
-    if (auto yuv = getFrame(cam, fr, segment_id, frame_id)) {
+    if (auto yuv = getFrame(cam, fr, segment_id)) {
       VisionIpcBufExtra extra = {
           .frame_id = frame_id,
           .timestamp_sof = eidx.getTimestampSof(),
           .timestamp_eof = eidx.getTimestampEof(),
       };
       vipc_server_->send(yuv, &extra);
+      std::lock_guard stats_lk(cam.stats_lock);
+      cam.stats.publish.add((nanos_since_boot() - push_time) / 1e6);
     } else {
       rError("camera[%d] failed to get frame: %lu", cam.type, segment_id);
     }
 
-    // Prefetch the next frame
-    getFrame(cam, fr, segment_id + 1, frame_id + 1);
+    // Restart decoding ahead from the requested frame if the stream caught up with it,
+    // or if the stream jumped (seek, next segment).
+    cam.requested_segment_id = segment_id;
+    if (segment_id >= cam.ahead_segment_id || segment_id + DECODE_AHEAD_FRAMES < cam.ahead_segment_id) {
+      cam.ahead_segment_id = segment_id + 1;
+    }
 
-    --publishing_;
+    frameSent(cam);
+  }
+}
+
+// Decodes the next frame after the last requested one. Frames are decoded in order,
+// so FrameReader doesn't have to seek back to a key frame for each of them.
+bool CameraServer::decodeAhead(Camera &cam) {
+  if (!cam.cache_fr || cam.ahead_segment_id < 0 || cam.ahead_segment_id >= cam.cache_fr->getFrameCount() ||
+      cam.ahead_segment_id > cam.requested_segment_id + DECODE_AHEAD_FRAMES) {
+    return false;
   }
+  getFrame(cam, cam.cache_fr, cam.ahead_segment_id++);
+  return true;
+}
+
+void CameraServer::clearCache(Camera &cam) {
+  cam.cache_fr.reset();
+  cam.cached_frames.clear();
+  cam.cache_order.clear();
+  cam.ahead_segment_id = cam.requested_segment_id = -1;
 }
 
-VisionBuf *CameraServer::getFrame(Camera &cam, FrameReader *fr, int32_t segment_id, uint32_t frame_id) {
+VisionBuf *CameraServer::getFrame(Camera &cam, const std::shared_ptr<FrameReader> &fr, int32_t segment_id) {
+  if (cam.cache_fr != fr) {
+    // frames are cached for one reader at a time
+    clearCache(cam);
+    cam.cache_fr = fr;
+  }
+
   // Check if the frame is cached
-  auto buf_it = std::find_if(cam.cached_buf.begin(), cam.cached_buf.end(),
-                             [frame_id](VisionBuf *buf) { return buf->get_frame_id() == frame_id; });
-  if (buf_it != cam.cached_buf.end()) return *buf_it;
+  if (auto it = cam.cached_frames.find(segment_id); it != cam.cached_frames.end()) {
+    if (cam.buf_seq - it->second.seq < BUFFER_COUNT) return it->second.buf;
+  }
 
   VisionBuf *yuv_buf = vipc_server_->get_buffer(cam.stream_type);
-  if (fr->get(segment_id, yuv_buf)) {
-    yuv_buf->set_frame_id(frame_id);
-    cam.cached_buf.insert(yuv_buf);
-    return yuv_buf;
+  const uint64_t seq = cam.buf_seq++;
+  const uint64_t start = nanos_since_boot();
+  if (!fr->get(segment_id, yuv_buf)) {
+    return nullptr;
   }
-  return nullptr;
+  {
+    std::lock_guard lk(cam.stats_lock);
+    cam.stats.decode.add((nanos_since_boot() - start) / 1e6);
+  }
+
+  cam.cached_frames[segment_id] = {yuv_buf, seq};
+  cam.cache_order.push_back(segment_id);
+  while (!cam.cache_order.empty()) {
+    auto it = cam.cached_frames.find(cam.cache_order.front());
+    if (it != cam.cached_frames.end() && cam.buf_seq - it->second.seq < BUFFER_COUNT) break;
+    if (it != cam.cached_frames.end()) cam.cached_frames.erase(it);
+    cam.cache_order.pop_front();
+  }
+  return yuv_buf;
 }
 
-void CameraServer::pushFrame(CameraType type, FrameReader *fr, const Event *event) {
+void CameraServer::pushFrame(CameraType type, std::shared_ptr<FrameReader> fr, const Event *event) {
   auto &cam = cameras_[type];
   if (cam.width != fr->width || cam.height != fr->height) {
     cam.width = fr->width;
     cam.height = fr->height;
     waitForSent();
+    // stop decoding ahead while the buffers are recreated
+    std::unique_lock<std::mutex> locks[MAX_CAMERAS];
+    for (int i = 0; i < MAX_CAMERAS; ++i) {
+      locks[i] = std::unique_lock(cameras_[i].mutex);
+    }
     startVipcServer();
   }
 
-  ++publishing_;
-  cam.queue.push({fr, event});
+  {
+    std::unique_lock lk(publish_lock_);
+    publish_cv_.wait(lk, [&cam]() { return cam.in_flight < MAX_IN_FLIGHT_FRAMES; });
+    ++cam.in_flight;
+    ++publishing_;
+  }
+  cam.queue.push({fr, event->data, nanos_since_boot()});
 }
 
-void CameraServer::waitForSent() {
-  while (publishing_ > 0) {
-    std::this_thread::yield();
+void CameraServer::frameSent(Camera &cam) {
+  {
+    std::lock_guard lk(publish_lock_);
+    --cam.in_flight;
+    --publishing_;
   }
+  publish_cv_.notify_all();
+}
+
+void CameraServer::waitForSent() {
+  std::unique_lock lk(publish_lock_);
+  publish_cv_.wait(lk, [this]() { return publishing_ == 0; });
+}
+
+CameraStats CameraServer::stats(CameraType type) {
+  auto &cam = cameras_[type];
+  std::lock_guard lk(cam.stats_lock);
+  return cam.stats;
 }
@@ -1,43 +1,80 @@
 #pragma once
 
+#include <condition_variable>
+#include <deque>
 #include <memory>
-#include <set>
 #include <tuple>
+#include <unordered_map>
 #include <utility>
 
 #include "msgq/visionipc/visionipc_server.h"
 #include "common/queue.h"
 #include "tools/replay/framereader.h"
 #include "tools/replay/logreader.h"
+#include "tools/replay/util.h"
 
 std::tuple<size_t, size_t, size_t> get_nv12_info(int width, int height);
 
+struct CameraStats {
+  LatencyHistogram decode;   // decoding a frame, including the ones decoded ahead
+  LatencyHistogram publish;  // from pushFrame until the frame is sent
+};
+
 class CameraServer {
 public:
   CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS] = nullptr);
   ~CameraServer();
-  void pushFrame(CameraType type, FrameReader* fr, const Event *event);
+  // blocks while the camera has MAX_IN_FLIGHT_FRAMES frames waiting to be sent
+  void pushFrame(CameraType type, std::shared_ptr<FrameReader> fr, const Event *event);
+  // blocks until all pushed frames are sent
   void waitForSent();
+  CameraStats stats(CameraType type);
 
 protected:
+  struct QueuedFrame {
+    std::shared_ptr<FrameReader> fr;
+    kj::ArrayPtr<const capnp::word> data;  // encodeIdx event
+    uint64_t push_time;
+  };
+  struct CachedFrame {
+    VisionBuf *buf;
+    uint64_t seq;  // value of Camera::buf_seq when the buffer was taken
+  };
   struct Camera {
     CameraType type;
     VisionStreamType stream_type;
     int width;
     int height;
     std::thread thread;
-    SafeQueue<std::pair<FrameReader*, const Event *>> queue;
-    std::set<VisionBuf *> cached_buf;
+    std::mutex mutex;  // held by the camera thread while decoding
+    SafeQueue<QueuedFrame> queue;
+    int in_flight = 0;  // frames pushed and not sent yet, guarded by publish_lock_
+    std::mutex stats_lock;
+    CameraStats stats;
+    // decoded frames of cache_fr by segment id, in decoding order.
+    // A vipc buffer is reused after BUFFER_COUNT get_buffer calls, entries older than that are dropped.
+    std::shared_ptr<FrameReader> cache_fr;
+    std::unordered_map<int32_t, CachedFrame> cached_frames;
+    std::deque<int32_t> cache_order;
+    uint64_t buf_seq = 0;
+    // the next frame decoded ahead of the stream, and the last frame that was requested
+    int32_t ahead_segment_id = -1;
+    int32_t requested_segment_id = -1;
   };
   void startVipcServer();
   void cameraThread(Camera &cam);
-  VisionBuf *getFrame(Camera &cam, FrameReader *fr, int32_t segment_id, uint32_t frame_id);
+  bool decodeAhead(Camera &cam);
+  void clearCache(Camera &cam);
+  void frameSent(Camera &cam);
+  VisionBuf *getFrame(Camera &cam, const std::shared_ptr<FrameReader> &fr, int32_t segment_id);
 
   Camera cameras_[MAX_CAMERAS] = {
       {.type = RoadCam, .stream_type = VISION_STREAM_ROAD},
       {.type = DriverCam, .stream_type = VISION_STREAM_DRIVER},
       {.type = WideRoadCam, .stream_type = VISION_STREAM_WIDE_ROAD},
   };
-  std::atomic<int> publishing_ = 0;
+  std::mutex publish_lock_;
+  std::condition_variable publish_cv_;
+  int publishing_ = 0;  // frames of all cameras pushed and not sent yet, guarded by publish_lock_
   std::unique_ptr<VisionIpcServer> vipc_server_;
 };
@@ -111,7 +111,7 @@ void ConsoleUI::initWindows() {
   w[Win::Stats] = newwin(2, max_width - 2 * BORDER_SIZE, 2, BORDER_SIZE);
   w[Win::Timeline] = newwin(4, max_width - 2 * BORDER_SIZE, 5, BORDER_SIZE);
   w[Win::TimelineDesc] = newwin(1, 100, 10, BORDER_SIZE);
-  w[Win::CarState] = newwin(3, 100, 12, BORDER_SIZE);
+  w[Win::CarState] = newwin(4, 120, 12, BORDER_SIZE);
   w[Win::DownloadBar] = newwin(1, 100, 16, BORDER_SIZE);
   if (int log_height = max_height - 27; log_height > 4) {
     w[Win::LogBorder] = newwin(log_height, max_width - 2 * (BORDER_SIZE - 1), 17, BORDER_SIZE - 1);
@@ -187,6 +187,19 @@ void ConsoleUI::updateStatus() {
   auto angle_offsets = util::string_format("%.2f|%.2f", p.getAngleOffsetAverageDeg(), p.getAngleOffsetDeg());
   write_item(2, 25, "ANGLE OFFSET(AVG|INSTANT): ", angle_offsets, " deg");
 
+  static const std::pair<CameraType, const char *> cameras[] = {{RoadCam, "road"}, {DriverCam, "driver"}, {WideRoadCam, "wide"}};
+  std::string latency;
+  for (auto [cam, name] : cameras) {
+    auto stats = replay->cameraStats(cam);
+    if (stats.publish.count() > 0) {
+      latency += util::string_format("%s %.0f/%.0f|%.0f/%.0f  ", name, stats.decode.percentile(50), stats.decode.percentile(99),
+                                     stats.publish.percentile(50), stats.publish.percentile(99));
+    }
+  }
+  if (!latency.empty()) {
+    write_item(3, 0, "FRAME LATENCY P50/P99(DECODE|PUBLISH): ", latency, "ms");
+  }
+
   wrefresh(w[Win::CarState]);
 }
 
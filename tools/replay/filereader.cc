@@ -1,19 +1,34 @@
 #include "tools/replay/filereader.h"
 
-#include <fstream>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <tuple>
+#include <vector>
 
 #include "common/util.h"
 #include "system/hardware/hw.h"
 #include "tools/replay/util.h"
 
-std::string cacheFilePath(const std::string &url) {
-  static std::string cache_path = [] {
-    const std::string comma_cache = Path::download_cache_root();
-    util::create_directories(comma_cache, 0755);
-    return comma_cache.back() == '/' ? comma_cache : comma_cache + "/";
-  }();
+namespace {
+
+bool isLocked(const std::string &file) {
+  int fd = HANDLE_EINTR(::open(file.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0) return false;
+  bool locked = HANDLE_EINTR(::flock(fd, LOCK_EX | LOCK_NB)) != 0;
+  ::close(fd);
+  return locked;
+}
 
-  return cache_path + sha256(getUrlWithoutQuery(url));
+}  // namespace
+
+std::string cacheFilePath(const std::string &url) {
+  return DownloadCache::instance().dir() + sha256(getUrlWithoutQuery(url));
 }
 
 std::string FileReader::read(const std::string &file, std::atomic<bool> *abort) {
@@ -23,27 +38,112 @@ std::string FileReader::read(const std::string &file, std::atomic<bool> *abort)
 
   if ((!is_remote || cache_to_local_) && util::file_exists(local_file)) {
     result = util::read_file(local_file);
+    if (is_remote) {
+      DownloadCache::instance().touch(local_file);
+    }
   } else if (is_remote) {
-    result = download(file, abort);
-    if (cache_to_local_ && !result.empty()) {
-      std::ofstream fs(local_file, std::ios::binary | std::ios::out);
-      fs.write(result.data(), result.size());
+    result = cache_to_local_ ? downloadToCache(file, local_file, abort) : download(file, abort);
+  }
+  return result;
+}
+
+// Downloads into a partial file next to the cached one, which is renamed once complete. An interrupted download
+// leaves the partial file behind and is continued from its end by the next attempt.
+std::string FileReader::downloadToCache(const std::string &url, const std::string &local_file, std::atomic<bool> *abort) {
+  const std::string part_file = local_file + ".part";
+  // another process is downloading the same file, don't write to the partial file at the same time
+  int fd = HANDLE_EINTR(::open(part_file.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+  if (fd < 0 || HANDLE_EINTR(::flock(fd, LOCK_EX | LOCK_NB)) != 0) {
+    if (fd >= 0) ::close(fd);
+    return download(url, abort);
+  }
+
+  std::string result;
+  if (httpDownload(url, part_file, chunk_size_, abort, max_retries_)) {
+    result = util::read_file(part_file);
+    if (result.empty() || !DownloadCache::instance().commit(part_file, local_file)) {
+      rWarning("failed to cache %s", getUrlWithoutQuery(url).c_str());
     }
   }
+  ::close(fd);
   return result;
 }
 
 std::string FileReader::download(const std::string &url, std::atomic<bool> *abort) {
-  for (int i = 0; i <= max_retries_ && !(abort && *abort); ++i) {
-    if (i > 0) {
-      rWarning("download failed, retrying %d", i);
-      util::sleep_for(3000);
+  // failed ranges are retried by httpGet
+  return httpGet(url, chunk_size_, abort, max_retries_);
+}
+
+// class DownloadCache
+
+DownloadCache::DownloadCache(const std::string &dir) : dir_(dir.back() == '/' ? dir : dir + "/") {
+  util::create_directories(dir_, 0755);
+}
+
+DownloadCache &DownloadCache::instance() {
+  static DownloadCache cache(Path::download_cache_root());
+  return cache;
+}
+
+void DownloadCache::touch(const std::string &file) {
+  ::utimes(file.c_str(), nullptr);
+}
+
+bool DownloadCache::commit(const std::string &tmp_file, const std::string &file) {
+  if (::rename(tmp_file.c_str(), file.c_str()) != 0) {
+    return false;
+  }
+  touch(file);
+  trim(file);
+  return true;
+}
+
+void DownloadCache::trim(const std::string &keep_file) {
+  const size_t max_size = max_size_;
+  if (max_size == 0) return;
+
+  std::lock_guard lk(trim_lock_);
+  std::vector<std::tuple<struct timespec, size_t, std::string>> files;
+  size_t total = 0;
+  if (DIR *d = ::opendir(dir_.c_str())) {
+    while (struct dirent *entry = ::readdir(d)) {
+      std::string path = dir_ + entry->d_name;
+      struct stat st = {};
+      if (::stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+        if (util::ends_with(path, ".part") && isLocked(path)) continue;  // being downloaded
+        files.push_back({st.st_mtim, st.st_size, path});
+        total += st.st_size;
+      }
+    }
+    ::closedir(d);
+  }
+  if (total <= max_size) return;
+
+  std::sort(files.begin(), files.end(), [](auto &l, auto &r) {
+    auto &lt = std::get<0>(l), &rt = std::get<0>(r);
+    return lt.tv_sec < rt.tv_sec || (lt.tv_sec == rt.tv_sec && lt.tv_nsec < rt.tv_nsec);
+  });
+  for (const auto &[mtime, size, path] : files) {
+    if (total <= max_size) break;
+    if (path == keep_file) continue;
+    // a file that is still open keeps its content until it is closed
+    if (::remove(path.c_str()) == 0) {
+      rDebug("removed %s from the download cache", path.c_str());
+      total -= size;
     }
+  }
+}
 
-    std::string result = httpGet(url, chunk_size_, abort);
-    if (!result.empty()) {
-      return result;
+size_t DownloadCache::size() const {
+  size_t total = 0;
+  if (DIR *d = ::opendir(dir_.c_str())) {
+    while (struct dirent *entry = ::readdir(d)) {
+      struct stat st = {};
+      if (::stat((dir_ + entry->d_name).c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+        total += st.st_size;
+      }
     }
+    ::closedir(d);
   }
-  return {};
+  return total;
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <atomic>
+#include <mutex>
 #include <string>
 
 class FileReader {
@@ -12,9 +13,33 @@ public:
 
 private:
   std::string download(const std::string &url, std::atomic<bool> *abort);
+  std::string downloadToCache(const std::string &url, const std::string &local_file, std::atomic<bool> *abort);
   size_t chunk_size_;
   int max_retries_;
   bool cache_to_local_;
 };
 
 std::string cacheFilePath(const std::string &url);
+
+// The directory downloaded files are cached in. If a size limit is set, the least recently used files are
+// removed once the cache grows beyond it. Files are marked as used by updating their modification time.
+class DownloadCache {
+public:
+  DownloadCache(const std::string &dir);
+  static DownloadCache &instance();
+  inline const std::string &dir() const { return dir_; }
+  // 0 is no limit
+  inline void setMaxSize(size_t bytes) { max_size_ = bytes; }
+  inline size_t maxSize() const { return max_size_; }
+  void touch(const std::string &file);
+  // moves tmp_file to file, which is then the most recently used one, and trims the cache
+  bool commit(const std::string &tmp_file, const std::string &file);
+  // removes the least recently used files until the cache fits in max size. keep_file is never removed.
+  void trim(const std::string &keep_file = {});
+  size_t size() const;
+
+private:
+  const std::string dir_;
+  std::atomic<size_t> max_size_ = 0;
+  std::mutex trim_lock_;
+};
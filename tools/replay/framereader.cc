@@ -1,5 +1,8 @@
 #include "tools/replay/framereader.h"
 
+#include <algorithm>
+#include <cstring>
+#include <fstream>
 #include <map>
 #include <memory>
 #include <tuple>
@@ -7,6 +10,7 @@
 
 #include "common/util.h"
 #include "third_party/libyuv/include/libyuv.h"
+#include "tools/replay/logindex.h"
 #include "tools/replay/util.h"
 
 #ifdef __APPLE__
@@ -29,27 +33,79 @@ enum AVPixelFormat get_hw_format(AVCodecContext *ctx, const enum AVPixelFormat *
   return AV_PIX_FMT_YUV420P;
 }
 
-struct DecoderManager {
-  VideoDecoder *acquire(CameraType type, AVCodecParameters *codecpar, bool hw_decoder) {
-    auto key = std::tuple(type, codecpar->width, codecpar->height);
-    std::unique_lock lock(mutex_);
-    if (auto it = decoders_.find(key); it != decoders_.end()) {
-      return it->second.get();
+// Decoders are leased to one reader at a time, so that readers of different segments can decode
+// concurrently. A decoder goes back to the reader it was last used by if possible: its state
+// is still positioned in that reader's stream, so sequential decoding doesn't have to seek.
+struct DecoderPool {
+  typedef std::tuple<CameraType, int, int> Key;
+
+  std::unique_ptr<VideoDecoder> acquire(const FrameReader *reader, AVCodecParameters *codecpar) {
+    Key key = std::tuple(reader->type_, codecpar->width, codecpar->height);
+    {
+      std::unique_lock lock(mutex_);
+      auto &idle = idle_[key];
+      if (!idle.empty()) {
+        auto it = std::find_if(idle.begin(), idle.end(), [reader](auto &d) { return d.second == reader; });
+        if (it == idle.end()) it = std::prev(idle.end());
+        auto decoder = std::move(it->first);
+        idle.erase(it);
+        return decoder;
+      }
     }
 
     auto decoder = std::make_unique<VideoDecoder>();
-    if (!decoder->open(codecpar, hw_decoder)) {
+    if (!decoder->open(codecpar, reader->hw_decoder_, thread_count)) {
       decoder.reset(nullptr);
     }
-    decoders_[key] = std::move(decoder);
-    return decoders_[key].get();
+    return decoder;
+  }
+
+  void release(const FrameReader *reader, AVCodecParameters *codecpar, std::unique_ptr<VideoDecoder> decoder) {
+    Key key = std::tuple(reader->type_, codecpar->width, codecpar->height);
+    std::unique_lock lock(mutex_);
+    idle_[key].emplace_back(std::move(decoder), reader);
+  }
+
+  // A freed reader's address may be reused. Its decoders are reset so that a new reader at the
+  // same address starts from a key frame instead of continuing the old reader's stream.
+  void forget(const FrameReader *reader) {
+    std::unique_lock lock(mutex_);
+    for (auto &[_, idle] : idle_) {
+      for (auto &d : idle) {
+        if (d.second == reader) {
+          d.first->reset();
+          d.second = nullptr;
+        }
+      }
+    }
   }
 
+  std::atomic<int> thread_count = 0;
   std::mutex mutex_;
-  std::map<std::tuple<CameraType, int, int>, std::unique_ptr<VideoDecoder>> decoders_;
+  std::map<Key, std::vector<std::pair<std::unique_ptr<VideoDecoder>, const FrameReader *>>> idle_;
 };
 
-DecoderManager decoder_manager;
+DecoderPool decoder_pool;
+
+const char PACKET_INDEX_MAGIC[4] = {'R', 'P', 'I', 'X'};
+const uint32_t PACKET_INDEX_VERSION = 1;
+
+struct PacketIndexHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t count;
+  char source_hash[64];
+};
+
+inline bool isStartCode(const char *p) {
+  return p[0] == 0 && p[1] == 0 && (p[2] == 1 || (p[2] == 0 && p[3] == 1));
+}
+
+// the index is validated against the video like the log index is against its log
+std::string videoHash(const std::string &file) {
+  MappedFile source(file);
+  return source.data() ? sourceHash(source.data(), source.size()) : std::string();
+}
 
 }  // namespace
 
@@ -58,21 +114,38 @@ FrameReader::FrameReader() {
 }
 
 FrameReader::~FrameReader() {
+  decoder_pool.forget(this);
   if (input_ctx) avformat_close_input(&input_ctx);
 }
 
+void setVideoDecoderThreads(int n) {
+  decoder_pool.thread_count = std::max(0, n);
+}
+
 bool FrameReader::load(CameraType type, const std::string &url, bool no_hw_decoder, std::atomic<bool> *abort, bool local_cache, int chunk_size, int retries) {
-  auto local_file_path = url.find("https://") == 0 ? cacheFilePath(url) : url;
+  return open(type, url, no_hw_decoder, abort, local_cache, chunk_size, retries) && buildPacketIndex({}, abort);
+}
+
+bool FrameReader::loadFromFile(CameraType type, const std::string &file, bool no_hw_decoder, std::atomic<bool> *abort) {
+  return openFile(type, file, no_hw_decoder) && buildPacketIndex({}, abort);
+}
+
+bool FrameReader::open(CameraType type, const std::string &url, bool no_hw_decoder, std::atomic<bool> *abort, bool local_cache, int chunk_size, int retries) {
+  const bool is_remote = url.find("https://") == 0;
+  auto local_file_path = is_remote ? cacheFilePath(url) : url;
   if (!util::file_exists(local_file_path)) {
     FileReader f(local_cache, chunk_size, retries);
     if (f.read(url, abort).empty()) {
       return false;
     }
+  } else if (is_remote) {
+    DownloadCache::instance().touch(local_file_path);
   }
-  return loadFromFile(type, local_file_path, no_hw_decoder, abort);
+  index_file_ = local_cache ? cacheFilePath(url) + ".pidx" : "";
+  return openFile(type, local_file_path, no_hw_decoder);
 }
 
-bool FrameReader::loadFromFile(CameraType type, const std::string &file, bool no_hw_decoder, std::atomic<bool> *abort) {
+bool FrameReader::openFile(CameraType type, const std::string &file, bool no_hw_decoder) {
   if (avformat_open_input(&input_ctx, file.c_str(), nullptr, nullptr) != 0 ||
       avformat_find_stream_info(input_ctx, nullptr) < 0) {
     rError("Failed to open input file or find video stream");
@@ -80,12 +153,28 @@ bool FrameReader::loadFromFile(CameraType type, const std::string &file, bool no
   }
   input_ctx->probesize = 10 * 1024 * 1024;  // 10MB
 
-  decoder_ = decoder_manager.acquire(type, input_ctx->streams[0]->codecpar, !no_hw_decoder);
-  if (!decoder_) {
+  file_ = file;
+  type_ = type;
+  hw_decoder_ = !no_hw_decoder;
+  auto codecpar = input_ctx->streams[0]->codecpar;
+  auto decoder = decoder_pool.acquire(this, codecpar);
+  if (!decoder) {
     return false;
   }
-  width = decoder_->width;
-  height = decoder_->height;
+  width = decoder->width;
+  height = decoder->height;
+  decoder_pool.release(this, codecpar, std::move(decoder));
+
+  // drop the packets read ahead while probing, decoding reads from the positions of the index
+  avformat_flush(input_ctx);
+  avio_seek(input_ctx->pb, 0, SEEK_SET);
+  return true;
+}
+
+bool FrameReader::buildPacketIndex(const std::vector<EncodeIdxPacket> &packets, std::atomic<bool> *abort) {
+  if (!input_ctx) return false;
+  if (!packets_info.empty()) return true;
+  if (indexFromEncodeIdx(packets) || loadIndexCache()) return true;
 
   AVPacket pkt;
   packets_info.reserve(60 * 20);  // 20fps, one minute
@@ -93,15 +182,125 @@ bool FrameReader::loadFromFile(CameraType type, const std::string &file, bool no
     packets_info.emplace_back(PacketInfo{.flags = pkt.flags, .pos = pkt.pos});
     av_packet_unref(&pkt);
   }
+  avformat_flush(input_ctx);
   avio_seek(input_ctx->pb, 0, SEEK_SET);
+  if (abort && *abort) {
+    packets_info.clear();
+    return false;
+  }
+  saveIndexCache();
+  return !packets_info.empty();
+}
+
+int64_t locateEncodeIdxPackets(const char *video, size_t size, const std::vector<EncodeIdxPacket> &packets,
+                               std::vector<int64_t> &positions) {
+  uint64_t data_size = 0;
+  for (size_t i = 0; i < packets.size(); ++i) {
+    if (packets[i].segment_id_encode != i) return -1;
+    data_size += packets[i].len;
+  }
+  if (!video || packets.empty() || data_size > size) return -1;
+  // decoding starts at the first packet, which must be a key frame
+  if (!(packets[0].flags & ENCODE_IDX_FLAG_KEYFRAME)) return -1;
+
+  // every packet must start with a NAL start code, which catches events of another video of the same size
+  const int64_t header_size = size - data_size;
+  positions.resize(packets.size());
+  int64_t pos = header_size;
+  for (size_t i = 0; i < packets.size(); ++i) {
+    if (packets[i].len < 4 || !isStartCode(video + pos)) {
+      return -1;
+    }
+    positions[i] = pos;
+    pos += packets[i].len;
+  }
+  return header_size;
+}
+
+bool FrameReader::indexFromEncodeIdx(std::vector<EncodeIdxPacket> packets) {
+  if (packets.empty()) return false;
+
+  std::sort(packets.begin(), packets.end(), [](auto &l, auto &r) { return l.segment_id_encode < r.segment_id_encode; });
+  MappedFile video(file_);
+  std::vector<int64_t> positions;
+  if (locateEncodeIdxPackets(video.data(), video.size(), packets, positions) < 0) {
+    rDebug("encodeIdx events don't match %s", file_.c_str());
+    return false;
+  }
+
+  packets_info.resize(packets.size());
+  for (size_t i = 0; i < packets.size(); ++i) {
+    packets_info[i].flags = packets[i].flags & ENCODE_IDX_FLAG_KEYFRAME ? AV_PKT_FLAG_KEY : 0;
+    packets_info[i].pos = i == 0 ? 0 : positions[i];  // the first packet includes the header
+  }
+  return true;
+}
+
+bool FrameReader::loadIndexCache() {
+  if (index_file_.empty()) return false;
+
+  std::string content = util::read_file(index_file_);
+  PacketIndexHeader header;
+  if (content.size() < sizeof(header)) return false;
+
+  memcpy(&header, content.data(), sizeof(header));
+  if (memcmp(header.magic, PACKET_INDEX_MAGIC, sizeof(header.magic)) != 0 || header.version != PACKET_INDEX_VERSION ||
+      content.size() != sizeof(header) + header.count * sizeof(PacketInfo) ||
+      std::string(header.source_hash, sizeof(header.source_hash)) != videoHash(file_)) {
+    return false;
+  }
+
+  std::vector<PacketInfo> index(header.count);
+  memcpy(index.data(), content.data() + sizeof(header), header.count * sizeof(PacketInfo));
+  const int64_t file_size = avio_size(input_ctx->pb);
+  for (const auto &p : index) {
+    if (p.pos < 0 || p.pos >= file_size) return false;
+  }
+  packets_info = std::move(index);
+  DownloadCache::instance().touch(index_file_);
   return !packets_info.empty();
 }
 
+void FrameReader::saveIndexCache() const {
+  if (index_file_.empty() || packets_info.empty()) return;
+
+  PacketIndexHeader header = {};
+  memcpy(header.magic, PACKET_INDEX_MAGIC, sizeof(header.magic));
+  header.version = PACKET_INDEX_VERSION;
+  header.count = packets_info.size();
+  std::string hash = videoHash(file_);
+  if (hash.size() != sizeof(header.source_hash)) return;
+  memcpy(header.source_hash, hash.data(), sizeof(header.source_hash));
+
+  // write to a temporary file first, so a concurrent reader never sees a partial index
+  const std::string tmp_file = index_file_ + "." + util::random_string(8) + ".tmp";
+  {
+    std::ofstream fs(tmp_file, std::ios::binary | std::ios::out);
+    fs.write((const char *)&header, sizeof(header));
+    fs.write((const char *)packets_info.data(), packets_info.size() * sizeof(PacketInfo));
+    if (!fs) {
+      fs.close();
+      ::remove(tmp_file.c_str());
+      return;
+    }
+  }
+  ::rename(tmp_file.c_str(), index_file_.c_str());
+}
+
 bool FrameReader::get(int idx, VisionBuf *buf) {
   if (!buf || idx < 0 || idx >= packets_info.size()) {
     return false;
   }
-  return decoder_->decode(this, idx, buf);
+
+  std::lock_guard lk(mutex_);
+  auto codecpar = input_ctx->streams[0]->codecpar;
+  auto decoder = decoder_pool.acquire(this, codecpar);
+  if (!decoder) {
+    return false;
+  }
+  bool ret = decoder->decode(this, idx, buf);
+  decoder_pool.release(this, codecpar, std::move(decoder));
+  return ret;
 }
 
 // class VideoDecoder
@@ -118,7 +317,7 @@ VideoDecoder::~VideoDecoder() {
   av_frame_free(&hw_frame_);
 }
 
-bool VideoDecoder::open(AVCodecParameters *codecpar, bool hw_decoder) {
+bool VideoDecoder::open(AVCodecParameters *codecpar, bool hw_decoder, int thread_count) {
   const AVCodec *decoder = avcodec_find_decoder(codecpar->codec_id);
   if (!decoder) return false;
 
@@ -133,6 +332,11 @@ bool VideoDecoder::open(AVCodecParameters *codecpar, bool hw_decoder) {
   if (hw_decoder && !initHardwareDecoder(HW_DEVICE_TYPE)) {
     rWarning("No device with hardware decoder found. fallback to CPU decoding.");
   }
+  if (hw_pix_fmt == AV_PIX_FMT_NONE) {
+    // frames come out thread_count - 1 packets late with frame threading, decode() accounts for it
+    decoder_ctx->thread_count = thread_count;
+    decoder_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  }
 
   if (avcodec_open2(decoder_ctx, decoder, nullptr) < 0) {
     rError("Failed to open codec");
@@ -168,46 +372,62 @@ bool VideoDecoder::initHardwareDecoder(AVHWDeviceType hw_device_type) {
 }
 
 bool VideoDecoder::decode(FrameReader *reader, int idx, VisionBuf *buf) {
-  int from_idx = idx;
-  if (idx != reader->prev_idx + 1) {
-    // seeking to the nearest key frame
-    for (int i = idx; i >= 0; --i) {
-      if (reader->packets_info[i].flags & AV_PKT_FLAG_KEY) {
-        from_idx = i;
-        break;
-      }
-    }
-    avio_seek(reader->input_ctx->pb, reader->packets_info[from_idx].pos, SEEK_SET);
+  // continue from the current state if idx is the next frame of the same reader,
+  // otherwise start over from the nearest key frame
+  if (reader != reader_ || idx != next_frame_ || draining_) {
+    seek(reader, idx);
   }
-  reader->prev_idx = idx;
 
-  bool result = false;
-  AVPacket pkt;
-  for (int i = from_idx; i <= idx; ++i) {
-    if (av_read_frame(reader->input_ctx, &pkt) == 0) {
-      AVFrame *f = decodeFrame(&pkt);
-      if (f && i == idx) {
-        result = copyBuffer(f, buf);
+  while (next_frame_ <= idx) {
+    int ret = avcodec_receive_frame(decoder_ctx, av_frame_);
+    if (ret == 0) {
+      if (next_frame_++ == idx) {
+        AVFrame *f = transferFrame();
+        return f && copyBuffer(f, buf);
       }
+      continue;
+    } else if (ret != AVERROR(EAGAIN)) {
+      if (ret != AVERROR_EOF) rError("avcodec_receive_frame error: %d", ret);
+      draining_ = true;  // forces a seek on the next call
+      break;
+    }
+
+    // the decoder needs more input
+    AVPacket pkt;
+    if (next_packet_ < (int)reader->packets_info.size() && av_read_frame(reader->input_ctx, &pkt) == 0) {
+      ret = avcodec_send_packet(decoder_ctx, &pkt);
       av_packet_unref(&pkt);
+      ++next_packet_;
+    } else {
+      // no more packets, flush the frames still in the decoder
+      ret = avcodec_send_packet(decoder_ctx, nullptr);
+      draining_ = true;
+    }
+    if (ret < 0) {
+      rError("Error sending a packet for decoding: %d", ret);
+      draining_ = true;  // forces a seek on the next call
+      break;
     }
   }
-  return result;
+  return false;
 }
 
-AVFrame *VideoDecoder::decodeFrame(AVPacket *pkt) {
-  int ret = avcodec_send_packet(decoder_ctx, pkt);
-  if (ret < 0) {
-    rError("Error sending a packet for decoding: %d", ret);
-    return nullptr;
-  }
-
-  ret = avcodec_receive_frame(decoder_ctx, av_frame_);
-  if (ret != 0) {
-    rError("avcodec_receive_frame error: %d", ret);
-    return nullptr;
+void VideoDecoder::seek(FrameReader *reader, int idx) {
+  int from_idx = 0;
+  for (int i = idx; i >= 0; --i) {
+    if (reader->packets_info[i].flags & AV_PKT_FLAG_KEY) {
+      from_idx = i;
+      break;
+    }
   }
+  avcodec_flush_buffers(decoder_ctx);
+  avio_seek(reader->input_ctx->pb, reader->packets_info[from_idx].pos, SEEK_SET);
+  reader_ = reader;
+  next_packet_ = next_frame_ = from_idx;
+  draining_ = false;
+}
 
+AVFrame *VideoDecoder::transferFrame() {
   if (av_frame_->format == hw_pix_fmt && av_hwframe_transfer_data(hw_frame_, av_frame_, 0) < 0) {
     rError("error transferring frame data from GPU to CPU");
     return nullptr;
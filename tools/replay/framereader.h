@@ -1,5 +1,6 @@
 #pragma once
 
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -14,6 +15,22 @@ extern "C" {
 
 class VideoDecoder;
 
+const uint32_t ENCODE_IDX_FLAG_KEYFRAME = 0x8;  // V4L2_BUF_FLAG_KEYFRAME, as set by the encoder
+
+// a packet of a video as described by the encodeIdx event of its frame
+struct EncodeIdxPacket {
+  uint32_t segment_id_encode;  // index of the packet in the video
+  uint32_t flags;
+  uint32_t len;
+};
+
+// Locates the packets of a raw hevc video written by loggerd, which writes the stream header followed by the
+// data of each encodeIdx in order. packets must be sorted by segment_id_encode. Returns the size of the header
+// and the position of each packet's data, or -1 if the packets don't match the video: the first packet is not
+// a key frame, or a packet doesn't start with a NAL start code.
+int64_t locateEncodeIdxPackets(const char *video, size_t size, const std::vector<EncodeIdxPacket> &packets,
+                               std::vector<int64_t> &positions);
+
 class FrameReader {
 public:
   FrameReader();
@@ -21,37 +38,71 @@ public:
   bool load(CameraType type, const std::string &url, bool no_hw_decoder = false, std::atomic<bool> *abort = nullptr, bool local_cache = false,
             int chunk_size = -1, int retries = 0);
   bool loadFromFile(CameraType type, const std::string &file, bool no_hw_decoder = false, std::atomic<bool> *abort = nullptr);
+  // downloads and opens the video without indexing its packets, see buildPacketIndex()
+  bool open(CameraType type, const std::string &url, bool no_hw_decoder = false, std::atomic<bool> *abort = nullptr, bool local_cache = false,
+            int chunk_size = -1, int retries = 0);
+  // Indexes the packets of an opened video from the encodeIdx events of its frames, from the
+  // cached index or by reading all packets, whichever works first. Only the last one costs a
+  // full pass over the file, its result is cached if the video was opened with the local cache.
+  bool buildPacketIndex(const std::vector<EncodeIdxPacket> &packets = {}, std::atomic<bool> *abort = nullptr);
   bool get(int idx, VisionBuf *buf);
   size_t getFrameCount() const { return packets_info.size(); }
+  // video data is read from the file while decoding, only the packet index is kept in memory
+  size_t memoryUsage() const { return packets_info.capacity() * sizeof(PacketInfo); }
 
   int width = 0, height = 0;
 
-  VideoDecoder *decoder_ = nullptr;
+  CameraType type_ = RoadCam;
+  bool hw_decoder_ = true;
+  std::mutex mutex_;  // one decode at a time per reader, readers of different segments decode concurrently
   AVFormatContext *input_ctx = nullptr;
-  int prev_idx = -1;
   struct PacketInfo {
     int flags;
     int64_t pos;
   };
   std::vector<PacketInfo> packets_info;
+
+private:
+  bool openFile(CameraType type, const std::string &file, bool no_hw_decoder);
+  bool indexFromEncodeIdx(std::vector<EncodeIdxPacket> packets);
+  bool loadIndexCache();
+  void saveIndexCache() const;
+
+  std::string file_;
+  std::string index_file_;  // empty if the index is not cached
 };
 
+// number of threads of software decoders, 0 lets libavcodec use one per core.
+// only affects decoders created afterwards.
+void setVideoDecoderThreads(int n);
 
 class VideoDecoder {
 public:
   VideoDecoder();
   ~VideoDecoder();
-  bool open(AVCodecParameters *codecpar, bool hw_decoder);
+  bool open(AVCodecParameters *codecpar, bool hw_decoder, int thread_count);
   bool decode(FrameReader *reader, int idx, VisionBuf *buf);
+  // forgets the decoding state, the next decode() seeks
+  void reset() {
+    reader_ = nullptr;
+    draining_ = true;
+  }
   int width = 0, height = 0;
 
 private:
   bool initHardwareDecoder(AVHWDeviceType hw_device_type);
-  AVFrame *decodeFrame(AVPacket *pkt);
+  void seek(FrameReader *reader, int idx);
+  AVFrame *transferFrame();
   bool copyBuffer(AVFrame *f, VisionBuf *buf);
 
   AVFrame *av_frame_, *hw_frame_;
   AVCodecContext *decoder_ctx = nullptr;
   AVPixelFormat hw_pix_fmt = AV_PIX_FMT_NONE;
   AVBufferRef *hw_device_ctx = nullptr;
+
+  // Decoding state. With frame threading, frames come out of the decoder some packets after they were sent.
+  const FrameReader *reader_ = nullptr;  // the reader whose packets were sent last
+  int next_packet_ = 0;  // next packet of reader_ to send
+  int next_frame_ = 0;   // index of the next frame to be received
+  bool draining_ = false;
 };
@@ -0,0 +1,113 @@
+#include "tools/replay/logindex.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#include "common/util.h"
+#include "tools/replay/filereader.h"
+#include "tools/replay/util.h"
+
+namespace {
+
+const char LOG_INDEX_MAGIC[4] = {'R', 'I', 'D', 'X'};
+const uint32_t LOG_INDEX_VERSION = 1;
+
+struct LogIndexHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t source_size;
+  char source_hash[64];
+  uint64_t decompressed_size;
+  uint64_t count;
+  char checksum[64];
+};
+
+std::string entriesChecksum(const std::vector<LogIndexEntry> &entries) {
+  return sha256(std::string((const char *)entries.data(), entries.size() * sizeof(LogIndexEntry)));
+}
+
+}  // namespace
+
+// hashing the whole source would cost as much as parsing it, so only the head and tail are hashed
+std::string sourceHash(const char *source, size_t size) {
+  const size_t sample_size = std::min<size_t>(size, 1024 * 1024);
+  std::string sample(source, sample_size);
+  sample.append(source + size - sample_size, sample_size);
+  sample.append(std::to_string(size));
+  return sha256(sample);
+}
+
+std::string logIndexFilePath(const std::string &url) {
+  return cacheFilePath(url) + ".idx";
+}
+
+bool LogIndex::load(const std::string &file, const char *source, size_t source_size) {
+  std::string content = util::read_file(file);
+  if (content.size() < sizeof(LogIndexHeader)) return false;
+
+  LogIndexHeader header;
+  memcpy(&header, content.data(), sizeof(header));
+  if (memcmp(header.magic, LOG_INDEX_MAGIC, sizeof(header.magic)) != 0 || header.version != LOG_INDEX_VERSION ||
+      header.source_size != source_size ||
+      content.size() != sizeof(header) + header.count * sizeof(LogIndexEntry)) {
+    return false;
+  }
+  if (std::string(header.source_hash, sizeof(header.source_hash)) != sourceHash(source, source_size)) {
+    rDebug("log index %s is stale", file.c_str());
+    return false;
+  }
+
+  entries.resize(header.count);
+  memcpy(entries.data(), content.data() + sizeof(header), header.count * sizeof(LogIndexEntry));
+  if (std::string(header.checksum, sizeof(header.checksum)) != entriesChecksum(entries)) {
+    rWarning("log index %s is corrupt", file.c_str());
+    entries.clear();
+    return false;
+  }
+
+  const uint64_t total_words = header.decompressed_size / sizeof(uint64_t);
+  for (const auto &e : entries) {
+    if (e.size == 0 || (uint64_t)e.offset + e.size > total_words) {
+      entries.clear();
+      return false;
+    }
+  }
+  decompressed_size = header.decompressed_size;
+  DownloadCache::instance().touch(file);
+  return !entries.empty();
+}
+
+bool LogIndex::save(const std::string &file, const char *source, size_t source_size) const {
+  LogIndexHeader header = {};
+  memcpy(header.magic, LOG_INDEX_MAGIC, sizeof(header.magic));
+  header.version = LOG_INDEX_VERSION;
+  header.source_size = source_size;
+  header.decompressed_size = decompressed_size;
+  header.count = entries.size();
+  std::string hash = sourceHash(source, source_size);
+  std::string checksum = entriesChecksum(entries);
+  memcpy(header.source_hash, hash.data(), sizeof(header.source_hash));
+  memcpy(header.checksum, checksum.data(), sizeof(header.checksum));
+
+  // write to a temporary file first, so a concurrent reader never sees a partial index
+  const std::string tmp_file = file + "." + util::random_string(8) + ".tmp";
+  {
+    std::ofstream fs(tmp_file, std::ios::binary | std::ios::out);
+    fs.write((const char *)&header, sizeof(header));
+    fs.write((const char *)entries.data(), entries.size() * sizeof(LogIndexEntry));
+    if (!fs) {
+      fs.close();
+      ::remove(tmp_file.c_str());
+      return false;
+    }
+  }
+  return ::rename(tmp_file.c_str(), file.c_str()) == 0;
+}
+
+// stable, so that entries end up in the same order as the events of a parsed log
+void LogIndex::sort() {
+  std::stable_sort(entries.begin(), entries.end(), [](const LogIndexEntry &l, const LogIndexEntry &r) {
+    return l.mono_time < r.mono_time || (l.mono_time == r.mono_time && l.which < r.which);
+  });
+}
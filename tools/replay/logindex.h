@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// One event of a parsed log, located by its position in the decompressed log.
+struct LogIndexEntry {
+  uint64_t mono_time;
+  uint32_t offset;  // in words
+  uint32_t size;    // in words
+  uint16_t which;
+  uint16_t reserved = 0;
+  int32_t eidx_segnum;
+};
+
+// Sorted events of a log, stored next to the download cache entry so that re-opening
+// the log skips parsing and sorting. The index is validated against the source file
+// it was built from, and its entries against a checksum.
+class LogIndex {
+public:
+  bool load(const std::string &file, const char *source, size_t source_size);
+  bool save(const std::string &file, const char *source, size_t source_size) const;
+  void sort();
+
+  uint64_t decompressed_size = 0;
+  std::vector<LogIndexEntry> entries;
+};
+
+std::string logIndexFilePath(const std::string &url);
+// the hash a cached index is validated with: the head and tail of the source and its size
+std::string sourceHash(const char *source, size_t size);
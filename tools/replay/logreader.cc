@@ -1,67 +1,455 @@
 #include "tools/replay/logreader.h"
 
 #include <algorithm>
+#include <cstring>
+#include <memory>
+#include <numeric>
+#include <type_traits>
 #include <utility>
 #include "tools/replay/filereader.h"
 #include "tools/replay/util.h"
 #include "common/util.h"
 
+namespace {
+
+// decompressed logs are parsed in blocks of this size
+const size_t LOG_BLOCK_SIZE = 8 * 1024 * 1024;
+// upper bound for a single message, guards against allocating for a corrupt size prefix
+const size_t MAX_MESSAGE_SIZE = 256 * 1024 * 1024;
+
+// the content decides over the file name, a cached bz2 log may have been transcoded to zstd
+bool hasBZ2Magic(const char *data, size_t size) { return size >= 4 && memcmp(data, "BZh9", 4) == 0; }
+bool hasZSTMagic(const char *data, size_t size) { return size >= 4 && memcmp(data, "\x28\xB5\x2F\xFD", 4) == 0; }
+
+bool isBZ2(const std::string &url, const char *data, size_t size) {
+  return hasBZ2Magic(data, size) || (!hasZSTMagic(data, size) && url.find(".bz2") != std::string::npos);
+}
+
+bool isZST(const std::string &url, const char *data, size_t size) {
+  return hasZSTMagic(data, size) || (!hasBZ2Magic(data, size) && url.find(".zst") != std::string::npos);
+}
+
+// decompresses the whole log into out, which has to be exactly as large as the decompressed log
+bool decompressLog(const std::string &url, const char *data, size_t size, char *out, size_t out_size, std::atomic<bool> *abort) {
+  std::vector<SeekableZstdFrame> frames;
+  if (isZST(url, data, size) && readSeekableZstdFrames((const std::byte *)data, size, frames)) {
+    return frames.back().offset + frames.back().size == out_size &&
+           decompressZSTSeekable((const std::byte *)data, size, frames, 0, out_size, out, abort);
+  }
+
+  size_t filled = 0;
+  auto on_data = [&](const char *chunk, size_t chunk_size) {
+    if (filled + chunk_size > out_size) return false;
+    memcpy(out + filled, chunk, chunk_size);
+    filled += chunk_size;
+    return true;
+  };
+  bool success = isBZ2(url, data, size) ? decompressBZ2((const std::byte *)data, size, on_data, abort)
+                                        : decompressZST((const std::byte *)data, size, on_data, abort);
+  return success && filled == out_size;
+}
+
+}  // namespace
+
 bool LogReader::load(const std::string &url, std::atomic<bool> *abort, bool local_cache, int chunk_size, int retries) {
-  std::string data = FileReader(local_cache, chunk_size, retries).read(url, abort);
-  if (!data.empty()) {
-    if (url.find(".bz2") != std::string::npos || util::starts_with(data, "BZh9")) {
-      data = decompressBZ2(data, abort);
-    } else if (url.find(".zst") != std::string::npos || util::starts_with(data, "\x28\xB5\x2F\xFD")) {
-      data = decompressZST(data, abort);
+  std::unique_ptr<MappedFile> mapped;
+  std::string content;
+  const char *data = nullptr;
+  size_t size = 0;
+  if (url.find("https://") != 0) {
+    // local logs are mapped rather than read, compressed ones are decompressed straight from the mapping
+    mapped = std::make_unique<MappedFile>(url);
+    data = mapped->data();
+    size = mapped->size();
+  } else {
+    content = FileReader(local_cache, chunk_size, retries).read(url, abort);
+    data = content.data();
+    size = content.size();
+  }
+  if (!data || size == 0) return false;
+
+  const bool compressed = isBZ2(url, data, size) || isZST(url, data, size);
+  const std::string index_file = local_cache ? logIndexFilePath(url) : "";
+  // a cached log is transcoded while it is parsed, so its index is not used
+  const bool transcode = cache_as_zstd_ && local_cache && !mapped && isBZ2(url, data, size);
+  bool success = false;
+  if (!index_file.empty() && !transcode) {
+    LogIndex index;
+    if (index.load(index_file, data, size)) {
+      success = loadFromIndex(index, url, compressed, data, size, abort);
+      if (!success) {
+        events.clear();
+        blocks_.clear();
+      }
+    }
+  }
+
+  if (!success && !(abort && *abort)) {
+    if (!index_file.empty()) {
+      index_ = std::make_unique<LogIndex>();
+    }
+    if (transcode) {
+      transcoder_ = std::make_unique<SeekableZstdWriter>();
+    }
+
+    std::vector<SeekableZstdFrame> frames;
+    if (isZST(url, data, size) && readSeekableZstdFrames((const std::byte *)data, size, frames)) {
+      success = loadSeekable(frames, data, size, abort);
+    } else {
+      success = compressed ? loadCompressed(url, data, size, abort) : load(data, size, abort);
+    }
+
+    // only logs that were parsed completely are transcoded and indexed
+    std::string transcoded;
+    if (success && transcoder_ && index_ && index_->decompressed_size > 0) {
+      transcoded = transcodeCacheFile(url);
     }
+    transcoder_.reset();
+    if (success && index_ && index_->decompressed_size > 0) {
+      index_->sort();
+      if (!transcoded.empty()) {
+        index_->save(index_file, transcoded.data(), transcoded.size());
+      } else {
+        index_->save(index_file, data, size);
+      }
+    }
+    index_.reset();
   }
 
-  bool success = !data.empty() && load(data.data(), data.size(), abort);
-  if (filters_.empty())
-    raw_ = std::move(data);
+  // Uncompressed logs are parsed in place. Unless filtered events were copied out,
+  // keep the source alive so that Event::data can point into it.
+  if (success && !compressed && filters_.empty()) {
+    mapped_file_ = std::move(mapped);
+    raw_ = std::move(content);
+  }
   return success;
 }
 
+// Rebuilds the events from a log index: the log only has to be decompressed, not parsed and sorted.
+bool LogReader::loadFromIndex(const LogIndex &index, const std::string &url, bool compressed,
+                              const char *data, size_t size, std::atomic<bool> *abort) {
+  if (index.decompressed_size % sizeof(capnp::word) != 0) return false;
+
+  kj::Array<capnp::word> block;
+  const capnp::word *log = (const capnp::word *)data;
+  if (compressed) {
+    block = kj::heapArray<capnp::word>(index.decompressed_size / sizeof(capnp::word));
+    if (!decompressLog(url, data, size, (char *)block.begin(), index.decompressed_size, abort)) return false;
+    log = block.begin();
+  } else if (size != index.decompressed_size) {
+    return false;
+  }
+
+  events.reserve(index.entries.size());
+  for (const auto &e : index.entries) {
+    kj::ArrayPtr<const capnp::word> event_data(log + e.offset, e.size);
+    if (!filters_.empty()) {
+      if (e.which >= filters_.size() || !filters_[e.which])
+        continue;
+      auto buf = buffer_.allocate(event_data.size() * sizeof(capnp::word));
+      memcpy(buf, event_data.begin(), event_data.size() * sizeof(capnp::word));
+      event_data = kj::arrayPtr((const capnp::word *)buf, event_data.size());
+    }
+    events.emplace_back((cereal::Event::Which)e.which, e.mono_time, event_data, e.eidx_segnum);
+  }
+
+  if (filters_.empty() && block.size() > 0) {
+    blocks_.push_back(std::move(block));
+  }
+  return !events.empty() && !(abort && *abort);
+}
+
+// Inflates the log into fixed-size blocks and parses every complete message as soon as it
+// has been decompressed, instead of decompressing the whole log into one buffer first.
+// A message that straddles the end of a block is moved to the start of the next block.
+// Blocks are kept alive for Event::data; with filters the events are copied, so one block is reused.
+bool LogReader::loadCompressed(const std::string &url, const char *data, size_t size, std::atomic<bool> *abort) {
+  events.reserve(65000);
+
+  kj::Array<capnp::word> block;
+  size_t filled = 0;  // bytes of decompressed data in the current block
+  size_t parsed = 0;  // bytes of complete messages parsed in the current block
+  size_t block_offset = 0;  // offset of the current block in the log, in words
+  bool corrupt = false;
+
+  auto next_block = [&]() {
+    const size_t pending = filled - parsed;
+    kj::ArrayPtr<const capnp::word> prefix(block.begin() + parsed / sizeof(capnp::word), pending / sizeof(capnp::word));
+    size_t words = std::max(capnp::expectedSizeInWordsFromPrefix(prefix), pending / sizeof(capnp::word) + 1);
+    if (words > MAX_MESSAGE_SIZE / sizeof(capnp::word)) {
+      rWarning("Failed to parse log : message of %zu bytes is too large", words * sizeof(capnp::word));
+      return false;
+    }
+    words = std::max(words, LOG_BLOCK_SIZE / sizeof(capnp::word));
+
+    if (!filters_.empty() && words <= block.size()) {
+      // filtered events are copied out, the block can be reused
+      memmove(block.begin(), (const char *)block.begin() + parsed, pending);
+      block_offset += parsed / sizeof(capnp::word);
+      filled = pending;
+      parsed = 0;
+      return true;
+    }
+
+    auto new_block = kj::heapArray<capnp::word>(words);
+    if (pending > 0) {
+      memcpy(new_block.begin(), (const char *)block.begin() + parsed, pending);
+    }
+    if (filters_.empty() && parsed > 0) {
+      blocks_.push_back(std::move(block));
+    }
+    block = std::move(new_block);
+    block_offset += parsed / sizeof(capnp::word);
+    filled = pending;
+    parsed = 0;
+    return true;
+  };
+
+  auto on_data = [&](const char *chunk, size_t chunk_size) {
+    if (transcoder_ && !transcoder_->write(chunk, chunk_size)) {
+      transcoder_.reset();
+    }
+    while (chunk_size > 0) {
+      if (filled == block.size() * sizeof(capnp::word) && !next_block()) {
+        corrupt = true;
+        return false;
+      }
+
+      const size_t n = std::min(chunk_size, block.size() * sizeof(capnp::word) - filled);
+      memcpy((char *)block.begin() + filled, chunk, n);
+      filled += n;
+      chunk += n;
+      chunk_size -= n;
+
+      try {
+        kj::ArrayPtr<const capnp::word> words(block.begin() + parsed / sizeof(capnp::word), (filled - parsed) / sizeof(capnp::word));
+        parsed += parseEvents(words, block_offset + parsed / sizeof(capnp::word), abort) * sizeof(capnp::word);
+      } catch (const kj::Exception &e) {
+        rWarning("Failed to parse log : %s.\nRetrieved %zu events from corrupt log", e.getDescription().cStr(), events.size());
+        corrupt = true;
+        return false;
+      }
+    }
+    return !(abort && *abort);
+  };
+
+  bool success = isBZ2(url, data, size) ? decompressBZ2((const std::byte *)data, size, on_data, abort)
+                                        : decompressZST((const std::byte *)data, size, on_data, abort);
+  if (!success && !corrupt) return false;
+
+  if (!corrupt && parsed < filled) {
+    rWarning("Failed to parse log : log is truncated.\nRetrieved %zu events from corrupt log", events.size());
+  } else if (!corrupt && index_) {
+    index_->decompressed_size = block_offset * sizeof(capnp::word) + filled;
+  }
+  if (filters_.empty() && parsed > 0) {
+    blocks_.push_back(std::move(block));
+  }
+  return finishLoading(abort);
+}
+
+// The frames of a seekable zstd log are decompressed in parallel into one block, which is parsed in place.
+bool LogReader::loadSeekable(const std::vector<SeekableZstdFrame> &frames, const char *data, size_t size, std::atomic<bool> *abort) {
+  const size_t decompressed_size = frames.back().offset + frames.back().size;
+  auto block = kj::heapArray<capnp::word>((decompressed_size + sizeof(capnp::word) - 1) / sizeof(capnp::word));
+  if (!decompressZSTSeekable((const std::byte *)data, size, frames, 0, decompressed_size, (char *)block.begin(), abort)) {
+    return false;
+  }
+  bool success = load((const char *)block.begin(), decompressed_size, abort);
+  if (success && filters_.empty()) {
+    blocks_.push_back(std::move(block));
+  }
+  return success;
+}
+
+// Replaces the cached bz2 log with the seekable zstd recompressed while it was loaded, returns the new content.
+std::string LogReader::transcodeCacheFile(const std::string &url) {
+  std::string content = transcoder_->finish();
+  const std::string cache_file = cacheFilePath(url);
+  const std::string tmp_file = cache_file + "." + util::random_string(8) + ".tmp";
+  if (content.empty() || util::write_file(tmp_file.c_str(), content.data(), content.size(), O_WRONLY | O_CREAT | O_TRUNC) != 0 ||
+      !DownloadCache::instance().commit(tmp_file, cache_file)) {
+    rWarning("failed to store %s as zstd", getUrlWithoutQuery(url).c_str());
+    ::remove(tmp_file.c_str());
+    return {};
+  }
+  rDebug("stored %s as zstd", getUrlWithoutQuery(url).c_str());
+  return content;
+}
+
 bool LogReader::load(const char *data, size_t size, std::atomic<bool> *abort) {
   try {
     events.reserve(65000);
     kj::ArrayPtr<const capnp::word> words((const capnp::word *)data, size / sizeof(capnp::word));
-    while (words.size() > 0 && !(abort && *abort)) {
-      capnp::FlatArrayMessageReader reader(words);
-      auto event = reader.getRoot<cereal::Event>();
-      auto which = event.which();
-      auto event_data = kj::arrayPtr(words.begin(), reader.getEnd());
-      words = kj::arrayPtr(reader.getEnd(), words.end());
-
-      if (!filters_.empty()) {
-        if (which >= filters_.size() || !filters_[which])
-          continue;
-        auto buf = buffer_.allocate(event_data.size() * sizeof(capnp::word));
-        memcpy(buf, event_data.begin(), event_data.size() * sizeof(capnp::word));
-        event_data = kj::arrayPtr((const capnp::word *)buf, event_data.size());
-      }
-
-      uint64_t mono_time = event.getLogMonoTime();
-      const Event &evt = events.emplace_back(which, mono_time, event_data);
-      // Add encodeIdx packet again as a frame packet for the video stream
-      if (evt.which == cereal::Event::ROAD_ENCODE_IDX ||
-          evt.which == cereal::Event::DRIVER_ENCODE_IDX ||
-          evt.which == cereal::Event::WIDE_ROAD_ENCODE_IDX) {
-        auto idx = capnp::AnyStruct::Reader(event).getPointerSection()[0].getAs<cereal::EncodeIndex>();
-        if (idx.getType() == cereal::EncodeIndex::Type::FULL_H_E_V_C) {
-          uint64_t sof = idx.getTimestampSof();
-          events.emplace_back(which, sof ? sof : mono_time, event_data, idx.getSegmentNum());
-        }
+    if (parseEvents(words, 0, abort) < words.size()) {
+      if (!(abort && *abort)) {
+        rWarning("Failed to parse log : log is truncated.\nRetrieved %zu events from corrupt log", events.size());
       }
+    } else if (index_ && size % sizeof(capnp::word) == 0) {
+      index_->decompressed_size = size;
     }
   } catch (const kj::Exception &e) {
     rWarning("Failed to parse log : %s.\nRetrieved %zu events from corrupt log", e.getDescription().cStr(), events.size());
   }
+  return finishLoading(abort);
+}
 
-  if (!events.empty() && !(abort && *abort)) {
-    events.shrink_to_fit();
-    std::sort(events.begin(), events.end());
-    return true;
+// Parses all complete messages in words and returns the number of words consumed.
+// Stops at a trailing message that is not complete yet. offset is the position of words
+// in the decompressed log, used for the entries of the index being built.
+size_t LogReader::parseEvents(kj::ArrayPtr<const capnp::word> words, size_t offset, std::atomic<bool> *abort) {
+  const capnp::word *begin = words.begin();
+  while (words.size() > 0 && !(abort && *abort)) {
+    if (capnp::expectedSizeInWordsFromPrefix(words) > words.size()) break;
+
+    capnp::FlatArrayMessageReader reader(words);
+    auto event = reader.getRoot<cereal::Event>();
+    auto which = event.which();
+    auto event_data = kj::arrayPtr(words.begin(), reader.getEnd());
+    words = kj::arrayPtr(reader.getEnd(), words.end());
+
+    uint64_t mono_time = event.getLogMonoTime();
+    uint64_t frame_time = 0;
+    int32_t eidx_segnum = -1;
+    // Add encodeIdx packet again as a frame packet for the video stream
+    if (which == cereal::Event::ROAD_ENCODE_IDX ||
+        which == cereal::Event::DRIVER_ENCODE_IDX ||
+        which == cereal::Event::WIDE_ROAD_ENCODE_IDX) {
+      auto idx = capnp::AnyStruct::Reader(event).getPointerSection()[0].getAs<cereal::EncodeIndex>();
+      if (idx.getType() == cereal::EncodeIndex::Type::FULL_H_E_V_C) {
+        uint64_t sof = idx.getTimestampSof();
+        frame_time = sof ? sof : mono_time;
+        eidx_segnum = idx.getSegmentNum();
+      }
+    }
+
+    if (index_) {
+      // the index covers every event, filters are applied when it is loaded
+      uint32_t event_offset = offset + (event_data.begin() - begin);
+      uint32_t event_size = event_data.size();
+      index_->entries.push_back({mono_time, event_offset, event_size, (uint16_t)which, 0, -1});
+      if (eidx_segnum != -1) {
+        index_->entries.push_back({frame_time, event_offset, event_size, (uint16_t)which, 0, eidx_segnum});
+      }
+    }
+
+    if (!filters_.empty()) {
+      if (which >= filters_.size() || !filters_[which])
+        continue;
+      auto buf = buffer_.allocate(event_data.size() * sizeof(capnp::word));
+      memcpy(buf, event_data.begin(), event_data.size() * sizeof(capnp::word));
+      event_data = kj::arrayPtr((const capnp::word *)buf, event_data.size());
+    }
+
+    events.emplace_back(which, mono_time, event_data);
+    if (eidx_segnum != -1) {
+      events.emplace_back(which, frame_time, event_data, eidx_segnum);
+    }
+  }
+  return words.begin() - begin;
+}
+
+size_t LogReader::memoryUsage() const {
+  size_t usage = events.memoryUsage() + raw_.capacity() + buffer_.allocatedSize();
+  for (const auto &block : blocks_) {
+    usage += block.size() * sizeof(capnp::word);
+  }
+  if (mapped_file_) {
+    usage += mapped_file_->size();
+  }
+  return usage;
+}
+
+bool LogReader::finishLoading(std::atomic<bool> *abort) {
+  bool success = !events.empty() && !(abort && *abort);
+  if (success) {
+    events.sort();
+  } else {
+    events.clear();
+  }
+  return success;
+}
+
+// EventTable
+
+EventTable::const_iterator EventTable::upperBound(const Event &evt) const {
+  size_t first = 0, count = size();
+  while (count > 0) {
+    size_t step = count / 2;
+    size_t i = first + step;
+    if (evt.mono_time < mono_time_[i] || (evt.mono_time == mono_time_[i] && evt.which < which_[i])) {
+      count = step;
+    } else {
+      first = i + 1;
+      count -= step + 1;
+    }
   }
-  return false;
+  return {this, (std::ptrdiff_t)first};
+}
+
+void EventTable::sort() {
+  auto less = [this](size_t l, size_t r) {
+    return mono_time_[l] < mono_time_[r] || (mono_time_[l] == mono_time_[r] && which_[l] < which_[r]);
+  };
+  bool sorted = true;
+  for (size_t i = 1; i < size() && sorted; ++i) {
+    sorted = !less(i, i - 1);
+  }
+  if (sorted) return;
+
+  // sort a permutation over the key columns, then move every column into that order
+  std::vector<uint32_t> order(size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), less);
+  auto permute = [&order](auto &column) {
+    std::decay_t<decltype(column)> sorted_column;
+    sorted_column.reserve(column.size());
+    for (uint32_t i : order) {
+      sorted_column.push_back(column[i]);
+    }
+    column = std::move(sorted_column);
+  };
+  permute(mono_time_);
+  permute(which_);
+  permute(data_);
+  permute(size_);
+  permute(eidx_segnum_);
+}
+
+void EventTable::emplace_back(cereal::Event::Which which, uint64_t mono_time, const kj::ArrayPtr<const capnp::word> &data, int eidx_segnum) {
+  mono_time_.push_back(mono_time);
+  which_.push_back(which);
+  data_.push_back(data.begin());
+  size_.push_back(data.size());
+  eidx_segnum_.push_back(eidx_segnum);
+}
+
+void EventTable::reserve(size_t n) {
+  mono_time_.reserve(n);
+  which_.reserve(n);
+  data_.reserve(n);
+  size_.reserve(n);
+  eidx_segnum_.reserve(n);
+}
+
+void EventTable::clear() {
+  mono_time_.clear();
+  which_.clear();
+  data_.clear();
+  size_.clear();
+  eidx_segnum_.clear();
+}
+
+size_t EventTable::memoryUsage() const {
+  return mono_time_.capacity() * sizeof(uint64_t) + which_.capacity() * sizeof(cereal::Event::Which) +
+         data_.capacity() * sizeof(const capnp::word *) + size_.capacity() * sizeof(uint32_t) +
+         eidx_segnum_.capacity() * sizeof(int32_t);
+}
+
+void EventTable::shrink_to_fit() {
+  mono_time_.shrink_to_fit();
+  which_.shrink_to_fit();
+  data_.shrink_to_fit();
+  size_.shrink_to_fit();
+  eidx_segnum_.shrink_to_fit();
 }
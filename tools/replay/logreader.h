@@ -1,10 +1,13 @@
 #pragma once
 
+#include <iterator>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "cereal/gen/cpp/log.capnp.h"
 #include "system/camerad/cameras/camera_common.h"
+#include "tools/replay/logindex.h"
 #include "tools/replay/util.h"
 
 const CameraType ALL_CAMERAS[] = {RoadCam, DriverCam, WideRoadCam};
@@ -25,16 +28,112 @@ public:
   int32_t eidx_segnum;
 };
 
+// The events of a log, stored column-wise: time-range searches and per-service
+// filtering only touch the contiguous mono_time and which columns. The iterators
+// yield Event by value, so it can be used like a container of Events.
+class EventTable {
+public:
+  class const_iterator {
+  public:
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = Event;
+    using difference_type = std::ptrdiff_t;
+    using reference = Event;
+    struct pointer {
+      Event e;
+      inline const Event *operator->() const { return &e; }
+    };
+
+    const_iterator() = default;
+    const_iterator(const EventTable *table, difference_type i) : table_(table), i_(i) {}
+    inline Event operator*() const { return (*table_)[i_]; }
+    inline pointer operator->() const { return {(*table_)[i_]}; }
+    inline Event operator[](difference_type n) const { return (*table_)[i_ + n]; }
+    inline difference_type index() const { return i_; }
+
+    inline const_iterator &operator++() { ++i_; return *this; }
+    inline const_iterator &operator--() { --i_; return *this; }
+    inline const_iterator operator++(int) { return {table_, i_++}; }
+    inline const_iterator operator--(int) { return {table_, i_--}; }
+    inline const_iterator &operator+=(difference_type n) { i_ += n; return *this; }
+    inline const_iterator &operator-=(difference_type n) { i_ -= n; return *this; }
+    inline const_iterator operator+(difference_type n) const { return {table_, i_ + n}; }
+    inline const_iterator operator-(difference_type n) const { return {table_, i_ - n}; }
+    inline difference_type operator-(const const_iterator &other) const { return i_ - other.i_; }
+    friend inline const_iterator operator+(difference_type n, const const_iterator &it) { return it + n; }
+
+    inline bool operator==(const const_iterator &other) const { return i_ == other.i_; }
+    inline bool operator!=(const const_iterator &other) const { return i_ != other.i_; }
+    inline bool operator<(const const_iterator &other) const { return i_ < other.i_; }
+    inline bool operator>(const const_iterator &other) const { return i_ > other.i_; }
+    inline bool operator<=(const const_iterator &other) const { return i_ <= other.i_; }
+    inline bool operator>=(const const_iterator &other) const { return i_ >= other.i_; }
+
+  private:
+    const EventTable *table_ = nullptr;
+    difference_type i_ = 0;
+  };
+
+  inline Event operator[](size_t i) const {
+    return Event(which_[i], mono_time_[i], kj::arrayPtr(data_[i], size_[i]), eidx_segnum_[i]);
+  }
+  inline uint64_t monoTime(size_t i) const { return mono_time_[i]; }
+  inline cereal::Event::Which which(size_t i) const { return which_[i]; }
+  inline size_t size() const { return mono_time_.size(); }
+  inline bool empty() const { return mono_time_.empty(); }
+  inline Event front() const { return (*this)[0]; }
+  inline Event back() const { return (*this)[size() - 1]; }
+  inline const_iterator begin() const { return {this, 0}; }
+  inline const_iterator end() const { return {this, (std::ptrdiff_t)size()}; }
+  inline const_iterator cbegin() const { return begin(); }
+  inline const_iterator cend() const { return end(); }
+  // returns the first event that is greater than evt, only the mono_time and which columns are searched.
+  const_iterator upperBound(const Event &evt) const;
+
+  void emplace_back(cereal::Event::Which which, uint64_t mono_time, const kj::ArrayPtr<const capnp::word> &data, int eidx_segnum = -1);
+  inline void push_back(const Event &e) { emplace_back(e.which, e.mono_time, e.data, e.eidx_segnum); }
+  // stable-sorts the events by mono_time and which
+  void sort();
+  void reserve(size_t n);
+  void clear();
+  void shrink_to_fit();
+  size_t memoryUsage() const;
+
+private:
+  std::vector<uint64_t> mono_time_;
+  std::vector<cereal::Event::Which> which_;
+  std::vector<const capnp::word *> data_;
+  std::vector<uint32_t> size_;
+  std::vector<int32_t> eidx_segnum_;
+};
+
 class LogReader {
 public:
   LogReader(const std::vector<bool> &filters = {}) { filters_ = filters; }
   bool load(const std::string &url, std::atomic<bool> *abort = nullptr,
             bool local_cache = false, int chunk_size = -1, int retries = 0);
   bool load(const char *data, size_t size, std::atomic<bool> *abort = nullptr);
-  std::vector<Event> events;
+  // store locally cached bz2 logs as seekable zstd, which later loads decompress in parallel
+  inline void setCacheAsZstd(bool enable) { cache_as_zstd_ = enable; }
+  // bytes held by the events and the log data they point into
+  size_t memoryUsage() const;
+  EventTable events;
 
 private:
+  bool loadFromIndex(const LogIndex &index, const std::string &url, bool compressed,
+                     const char *data, size_t size, std::atomic<bool> *abort);
+  bool loadCompressed(const std::string &url, const char *data, size_t size, std::atomic<bool> *abort);
+  bool loadSeekable(const std::vector<SeekableZstdFrame> &frames, const char *data, size_t size, std::atomic<bool> *abort);
+  std::string transcodeCacheFile(const std::string &url);
+  size_t parseEvents(kj::ArrayPtr<const capnp::word> words, size_t offset, std::atomic<bool> *abort);
+  bool finishLoading(std::atomic<bool> *abort);
+
   std::string raw_;
+  std::unique_ptr<MappedFile> mapped_file_;
+  std::vector<kj::Array<capnp::word>> blocks_;
+  std::unique_ptr<LogIndex> index_;  // built while parsing, if the log is cached locally
+  std::unique_ptr<SeekableZstdWriter> transcoder_;  // recompresses a cached bz2 log while it is decompressed
+  bool cache_as_zstd_ = false;
   std::vector<bool> filters_;
   MonotonicBuffer buffer_{1024 * 1024};
 };
@@ -22,7 +22,11 @@ int main(int argc, char *argv[]) {
       {"no-hw-decoder", REPLAY_FLAG_NO_HW_DECODER, "disable HW video decoding"},
       {"no-vipc", REPLAY_FLAG_NO_VIPC, "do not output video"},
       {"all", REPLAY_FLAG_ALL_SERVICES, "do output all messages including uiDebug, userFlag"
-                                        ". this may causes issues when used along with UI"}
+                                        ". this may causes issues when used along with UI"},
+      {"flow-control", REPLAY_FLAG_FLOW_CONTROL, "publish as fast as the readers consume the messages"
+                                                 ", instead of in real time"},
+      {"zstd-cache", REPLAY_FLAG_ZSTD_CACHE, "store cached bz2 logs as seekable zstd, which loads faster"},
+      {"progressive", REPLAY_FLAG_PROGRESSIVE, "start playing the qlogs, the rlogs replace them once loaded"},
   };
 
   QCommandLineParser parser;
@@ -32,12 +36,17 @@ int main(int argc, char *argv[]) {
   parser.addOption({{"a", "allow"}, "whitelist of services to send", "allow"});
   parser.addOption({{"b", "block"}, "blacklist of services to send", "block"});
   parser.addOption({{"c", "cache"}, "cache <n> segments in memory. default is 5", "n"});
+  parser.addOption({"cache-budget", "cache as many segments as fit in <mb> megabytes of memory instead", "mb"});
+  parser.addOption({"prefetch", "load up to <n> segments at the same time. default is 2", "n"});
+  parser.addOption({"flow-control-timeout", "with --flow-control, stop waiting for slow readers after <ms>. 0 waits forever. default is 1000", "ms"});
   parser.addOption({{"s", "start"}, "start from <seconds>", "seconds"});
   parser.addOption({"x", QString("playback <speed>. between %1 - %2")
                         .arg(ConsoleUI::speed_array.front()).arg(ConsoleUI::speed_array.back()), "speed"});
   parser.addOption({"demo", "use a demo route instead of providing your own"});
   parser.addOption({"data_dir", "local directory with routes", "data_dir"});
   parser.addOption({"prefix", "set OPENPILOT_PREFIX", "prefix"});
+  parser.addOption({"download-cache-size", "limit the cache of downloaded files to <mb> megabytes", "mb"});
+  parser.addOption({"decoder-threads", "use <n> threads per video decoder when decoding on CPU. default is one per core", "n"});
   for (auto &[name, _, desc] : flags) {
     parser.addOption({name, desc});
   }
@@ -65,10 +74,27 @@ int main(int argc, char *argv[]) {
     op_prefix.reset(new OpenpilotPrefix(prefix.toStdString()));
   }
 
+  if (!parser.value("download-cache-size").isEmpty()) {
+    DownloadCache::instance().setMaxSize(parser.value("download-cache-size").toULongLong() * 1024 * 1024);
+    DownloadCache::instance().trim();
+  }
+  if (!parser.value("decoder-threads").isEmpty()) {
+    setVideoDecoderThreads(parser.value("decoder-threads").toInt());
+  }
+
   Replay *replay = new Replay(route, allow, block, nullptr, replay_flags, parser.value("data_dir"), &app);
   if (!parser.value("c").isEmpty()) {
     replay->setSegmentCacheLimit(parser.value("c").toInt());
   }
+  if (!parser.value("cache-budget").isEmpty()) {
+    replay->setCacheMemoryBudget(parser.value("cache-budget").toULongLong() * 1024 * 1024);
+  }
+  if (!parser.value("prefetch").isEmpty()) {
+    replay->setConcurrentLoads(parser.value("prefetch").toInt());
+  }
+  if (!parser.value("flow-control-timeout").isEmpty()) {
+    replay->setFlowControlTimeout(parser.value("flow-control-timeout").toInt());
+  }
   if (!parser.value("x").isEmpty()) {
     replay->setSpeed(std::clamp(parser.value("x").toFloat(),
                                 ConsoleUI::speed_array.front(), ConsoleUI::speed_array.back()));
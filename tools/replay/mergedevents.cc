@@ -0,0 +1,92 @@
+#include "tools/replay/mergedevents.h"
+
+#include <algorithm>
+#include <optional>
+
+namespace {
+
+// orders the heads by the event's (mono_time, which) like Event::operator<, the events of
+// an earlier segment go first on a tie, as a stable merge in segment order would put them.
+struct HeadGreater {
+  template <class Head>
+  bool operator()(const Head &l, const Head &r) const {
+    const uint64_t l_time = l.events->monoTime(l.i), r_time = r.events->monoTime(r.i);
+    if (l_time != r_time) return l_time > r_time;
+    const auto l_which = l.events->which(l.i), r_which = r.events->which(r.i);
+    if (l_which != r_which) return l_which > r_which;
+    return l.seg_num > r.seg_num;
+  }
+};
+
+}  // namespace
+
+bool MergedEvents::Cursor::skipFiltered(Head &head) const {
+  const size_t size = head.events->size();
+  if (services_ && !services_->empty()) {
+    while (head.i < size) {
+      const size_t which = static_cast<size_t>(head.events->which(head.i));
+      if (which < services_->size() && (*services_)[which]) break;
+      ++head.i;
+    }
+  }
+  return head.i < size;
+}
+
+void MergedEvents::Cursor::next() {
+  std::pop_heap(heads_.begin(), heads_.end(), HeadGreater());
+  auto &head = heads_.back();
+  ++head.i;
+  if (skipFiltered(head)) {
+    std::push_heap(heads_.begin(), heads_.end(), HeadGreater());
+  } else {
+    heads_.pop_back();
+  }
+}
+
+void MergedEvents::insert(int seg_num, const EventTable *events) {
+  spans_[seg_num] = events;
+}
+
+void MergedEvents::erase(int seg_num) {
+  spans_.erase(seg_num);
+}
+
+std::set<int> MergedEvents::segments() const {
+  std::set<int> segments;
+  for (const auto &[n, _] : spans_) {
+    segments.insert(n);
+  }
+  return segments;
+}
+
+size_t MergedEvents::size() const {
+  size_t size = 0;
+  for (const auto &[_, events] : spans_) {
+    size += events->size();
+  }
+  return size;
+}
+
+Event MergedEvents::back() const {
+  std::optional<Event> last;
+  for (const auto &[_, events] : spans_) {
+    if (!events->empty() && (!last || *last < events->back())) {
+      last = events->back();
+    }
+  }
+  return *last;
+}
+
+MergedEvents::Cursor MergedEvents::upperBound(const Event &evt) const {
+  Cursor cursor;
+  cursor.services_ = &services_;
+  cursor.heads_.reserve(spans_.size());
+  for (const auto &[seg_num, events] : spans_) {
+    Cursor::Head head = {events, (size_t)events->upperBound(evt).index(), seg_num};
+    if (cursor.skipFiltered(head)) {
+      cursor.heads_.push_back(head);
+    }
+  }
+  std::make_heap(cursor.heads_.begin(), cursor.heads_.end(), HeadGreater());
+  return cursor;
+}
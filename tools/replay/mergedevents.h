@@ -0,0 +1,51 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include "tools/replay/logreader.h"
+
+// The events of the merged segments, kept as one sorted span per segment instead of
+// a single merged copy. Adding or removing a segment only touches that segment's span;
+// a cursor merges the spans on the fly while streaming.
+class MergedEvents {
+public:
+  class Cursor {
+  public:
+    inline bool end() const { return heads_.empty(); }
+    inline Event operator*() const { return (*heads_.front().events)[heads_.front().i]; }
+    inline EventTable::const_iterator::pointer operator->() const { return {**this}; }
+    void next();
+
+  private:
+    friend class MergedEvents;
+    struct Head {
+      const EventTable *events;
+      size_t i;
+      int seg_num;
+    };
+    // moves the head to the first event at or after its position that is in services_, returns false at the end
+    bool skipFiltered(Head &head) const;
+
+    std::vector<Head> heads_;  // min-heap on the current event of each span
+    const std::vector<bool> *services_ = nullptr;
+  };
+
+  // only the events of these services are merged, all events are merged if it is empty
+  void setServices(const std::vector<bool> &services) { services_ = services; }
+  void insert(int seg_num, const EventTable *events);
+  void erase(int seg_num);
+  inline bool contains(int seg_num) const { return spans_.count(seg_num) > 0; }
+  std::set<int> segments() const;
+  inline bool empty() const { return size() == 0; }
+  size_t size() const;
+  // the latest event of all segments. must not be called if empty.
+  Event back() const;
+  // returns a cursor at the first event that is greater than evt
+  Cursor upperBound(const Event &evt) const;
+
+private:
+  std::map<int, const EventTable *> spans_;
+  std::vector<bool> services_;
+};
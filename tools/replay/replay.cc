@@ -1,16 +1,25 @@
 #include "tools/replay/replay.h"
 
 #include <QDebug>
+#include <QFileInfo>
 #include <QtConcurrent>
 #include <capnp/dynamic.h>
 #include <csignal>
+#include <cstring>
+#include <fstream>
+#include <thread>
 #include "cereal/services.h"
 #include "common/params.h"
 #include "common/timing.h"
+#include "common/util.h"
+#include "tools/replay/filereader.h"
 #include "tools/replay/util.h"
 
 static void interrupt_sleep_handler(int signal) {}
 
+// events up to this far apart are delivered to an in-process SubMaster in one update
+const uint64_t SM_BATCH_WINDOW_NS = 1e6;
+
 Replay::Replay(QString route, QStringList allow, QStringList block, SubMaster *sm_,
                uint32_t flags, QString data_dir, QObject *parent) : sm(sm_), flags_(flags), QObject(parent) {
   // Register signal handler for SIGUSR1
@@ -32,6 +41,12 @@ Replay::Replay(QString route, QStringList allow, QStringList block, SubMaster *s
       filters_.push_back(i == cereal::Event::Which::INIT_DATA || i == cereal::Event::Which::CAR_PARAMS || sockets_[i]);
     }
   }
+  // the events of services without a socket are not merged
+  std::vector<bool> merged_services(sockets_.size());
+  for (int i = 0; i < sockets_.size(); ++i) {
+    merged_services[i] = sockets_[i] != nullptr;
+  }
+  events_.setServices(merged_services);
 
   std::vector<const char *> s;
   std::copy_if(sockets_.begin(), sockets_.end(), std::back_inserter(s),
@@ -41,8 +56,11 @@ Replay::Replay(QString route, QStringList allow, QStringList block, SubMaster *s
 
   if (sm == nullptr) {
     pm = std::make_unique<PubMaster>(s);
+  } else {
+    sm_batch_services_.resize(sockets_.size());
   }
   route_ = std::make_unique<Route>(route, data_dir);
+  setConcurrentLoads(DEFAULT_CONCURRENT_LOADS);
 }
 
 Replay::~Replay() {
@@ -149,7 +167,94 @@ void Replay::seekToFlag(FindFlag flag) {
   }
 }
 
+namespace {
+
+const char TIMELINE_CACHE_MAGIC[4] = {'R', 'T', 'L', 'N'};
+const uint32_t TIMELINE_CACHE_VERSION = 1;
+
+struct TimelineCacheHeader {
+  char magic[4];
+  uint32_t version;
+  double max_seconds;
+  uint64_t count;
+};
+
+struct TimelineCacheEntry {
+  double begin;
+  double end;
+  int32_t type;
+};
+
+// the changes of controlsState and the user flags of one segment's qlog
+struct SegmentTimeline {
+  struct State {
+    uint64_t mono_time;
+    bool enabled;
+    std::string alert_type;
+    cereal::ControlsState::AlertSize alert_size;
+    cereal::ControlsState::AlertStatus alert_status;
+  };
+  bool loaded = false;
+  std::vector<State> states;
+  std::vector<uint64_t> user_flags;
+  uint64_t last_mono_time = 0;
+};
+
+}  // namespace
+
+// The qlogs are scanned in parallel, each scan only keeps the points where the engagement or the alert changes.
+// Those are stitched together in segment order as soon as all previous segments are scanned, because an
+// engagement or alert may span several segments. qLogLoaded is emitted in segment order from there as well.
 void Replay::buildTimeline() {
+  const bool cached = !hasFlag(REPLAY_FLAG_NO_FILE_CACHE) && loadTimelineCache();
+  const bool emit_qlogs = isSignalConnected(QMetaMethod::fromSignal(&Replay::qLogLoaded));
+  if (cached && !emit_qlogs) return;
+
+  QList<SegmentFile> segment_files;
+  for (const auto &[n, files] : route_->segments()) {
+    segment_files.push_back(files);
+  }
+  // the qlog of each segment until it is emitted, the results of the future are kept until it is destroyed
+  std::vector<std::shared_ptr<LogReader>> qlogs(segment_files.size());
+  QList<int> segment_indexes;
+  for (int i = 0; i < segment_files.size(); ++i) {
+    segment_indexes.push_back(i);
+  }
+
+  auto scan = [&, this](const int &i) {
+    SegmentTimeline result;
+    if (exit_) return result;
+
+    const SegmentFile &files = segment_files[i];
+
+    std::shared_ptr<LogReader> log(new LogReader());
+    if (!log->load(files.qlog.toStdString(), &exit_, !hasFlag(REPLAY_FLAG_NO_FILE_CACHE), 0, 3) || log->events.empty()) {
+      return result;
+    }
+
+    for (const Event &e : log->events) {
+      if (e.which == cereal::Event::Which::CONTROLS_STATE) {
+        capnp::FlatArrayMessageReader reader(e.data);
+        auto cs = reader.getRoot<cereal::Event>().getControlsState();
+        const auto *prev = result.states.empty() ? nullptr : &result.states.back();
+        if (!prev || prev->enabled != cs.getEnabled() || prev->alert_type != cs.getAlertType().cStr() ||
+            prev->alert_status != cs.getAlertStatus()) {
+          result.states.push_back({e.mono_time, cs.getEnabled(), cs.getAlertType().cStr(), cs.getAlertSize(), cs.getAlertStatus()});
+        }
+      } else if (e.which == cereal::Event::Which::USER_FLAG) {
+        result.user_flags.push_back(e.mono_time);
+      }
+    }
+    result.last_mono_time = log->events.back().mono_time;
+    result.loaded = true;
+    if (emit_qlogs) {
+      qlogs[i] = log;
+    }
+    return result;
+  };
+
+  QFuture<SegmentTimeline> future = QtConcurrent::mapped(segment_indexes, std::function<SegmentTimeline(const int &)>(scan));
+
   uint64_t engaged_begin = 0;
   bool engaged = false;
 
@@ -164,58 +269,133 @@ void Replay::buildTimeline() {
     [(int)cereal::ControlsState::AlertStatus::CRITICAL] = TimelineType::AlertCritical,
   };
 
-  const auto &route_segments = route_->segments();
-  for (auto it = route_segments.cbegin(); it != route_segments.cend() && !exit_; ++it) {
-    std::shared_ptr<LogReader> log(new LogReader());
-    if (!log->load(it->second.qlog.toStdString(), &exit_, !hasFlag(REPLAY_FLAG_NO_FILE_CACHE), 0, 3) || log->events.empty()) continue;
+  bool complete = true;
+  for (int i = 0; i < segment_files.size() && !exit_; ++i) {
+    // waits for the scan of segment i
+    const SegmentTimeline seg = future.resultAt(i);
+    if (auto qlog = std::move(qlogs[i])) {
+      emit qLogLoaded(qlog);
+    }
+    if (cached) continue;
+
+    if (!seg.loaded) {
+      complete = false;
+      continue;
+    }
 
     std::vector<std::tuple<double, double, TimelineType>> timeline;
-    for (const Event &e : log->events) {
-      if (e.which == cereal::Event::Which::CONTROLS_STATE) {
-        capnp::FlatArrayMessageReader reader(e.data);
-        auto event = reader.getRoot<cereal::Event>();
-        auto cs = event.getControlsState();
-
-        if (engaged != cs.getEnabled()) {
-          if (engaged) {
-            timeline.push_back({toSeconds(engaged_begin), toSeconds(e.mono_time), TimelineType::Engaged});
-          }
-          engaged_begin = e.mono_time;
-          engaged = cs.getEnabled();
+    for (const auto &state : seg.states) {
+      if (engaged != state.enabled) {
+        if (engaged) {
+          timeline.push_back({toSeconds(engaged_begin), toSeconds(state.mono_time), TimelineType::Engaged});
         }
+        engaged_begin = state.mono_time;
+        engaged = state.enabled;
+      }
 
-        if (alert_type != cs.getAlertType().cStr() || alert_status != cs.getAlertStatus()) {
-          if (!alert_type.empty() && alert_size != cereal::ControlsState::AlertSize::NONE) {
-            timeline.push_back({toSeconds(alert_begin), toSeconds(e.mono_time), timeline_types[(int)alert_status]});
-          }
-          alert_begin = e.mono_time;
-          alert_type = cs.getAlertType().cStr();
-          alert_size = cs.getAlertSize();
-          alert_status = cs.getAlertStatus();
+      if (alert_type != state.alert_type || alert_status != state.alert_status) {
+        if (!alert_type.empty() && alert_size != cereal::ControlsState::AlertSize::NONE) {
+          timeline.push_back({toSeconds(alert_begin), toSeconds(state.mono_time), timeline_types[(int)alert_status]});
         }
-      } else if (e.which == cereal::Event::Which::USER_FLAG) {
-        timeline.push_back({toSeconds(e.mono_time), toSeconds(e.mono_time), TimelineType::UserFlag});
+        alert_begin = state.mono_time;
+        alert_type = state.alert_type;
+        alert_size = state.alert_size;
+        alert_status = state.alert_status;
       }
     }
+    for (uint64_t mono_time : seg.user_flags) {
+      timeline.push_back({toSeconds(mono_time), toSeconds(mono_time), TimelineType::UserFlag});
+    }
 
-    if (it->first == route_segments.rbegin()->first) {
+    if (i == segment_files.size() - 1) {
       if (engaged) {
-        timeline.push_back({toSeconds(engaged_begin), toSeconds(log->events.back().mono_time), TimelineType::Engaged});
+        timeline.push_back({toSeconds(engaged_begin), toSeconds(seg.last_mono_time), TimelineType::Engaged});
       }
       if (!alert_type.empty() && alert_size != cereal::ControlsState::AlertSize::NONE) {
-        timeline.push_back({toSeconds(alert_begin), toSeconds(log->events.back().mono_time), timeline_types[(int)alert_status]});
+        timeline.push_back({toSeconds(alert_begin), toSeconds(seg.last_mono_time), timeline_types[(int)alert_status]});
       }
 
-      max_seconds_ = std::ceil(toSeconds(log->events.back().mono_time));
-      emit minMaxTimeChanged(route_segments.cbegin()->first * 60.0, max_seconds_);
+      max_seconds_ = std::ceil(toSeconds(seg.last_mono_time));
+      emit minMaxTimeChanged(route_->segments().cbegin()->first * 60.0, max_seconds_);
     }
     {
       std::lock_guard lk(timeline_lock);
-      timeline_.insert(timeline_.end(), timeline.begin(), timeline.end());
-      std::sort(timeline_.begin(), timeline_.end(), [](auto &l, auto &r) { return std::get<2>(l) < std::get<2>(r); });
+      timeline_.insert(timeline.begin(), timeline.end());
+    }
+  }
+
+  future.waitForFinished();
+  if (!cached && complete && !exit_ && !hasFlag(REPLAY_FLAG_NO_FILE_CACHE)) {
+    saveTimelineCache();
+  }
+}
+
+// the cache is keyed by the qlogs of the route, local files also by their size so that a rewritten log invalidates it
+std::string Replay::timelineCacheFilePath() const {
+  std::string key = "timeline";
+  for (const auto &[n, files] : route_->segments()) {
+    const std::string qlog = files.qlog.toStdString();
+    key += "|" + getUrlWithoutQuery(qlog);
+    if (qlog.find("https://") != 0) {
+      key += ":" + std::to_string(QFileInfo(files.qlog).size());
+    }
+  }
+  return cacheFilePath(key) + ".timeline";
+}
+
+bool Replay::loadTimelineCache() {
+  std::string content = util::read_file(timelineCacheFilePath());
+  if (content.size() < sizeof(TimelineCacheHeader)) return false;
+
+  TimelineCacheHeader header;
+  memcpy(&header, content.data(), sizeof(header));
+  if (memcmp(header.magic, TIMELINE_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != TIMELINE_CACHE_VERSION ||
+      content.size() != sizeof(header) + header.count * sizeof(TimelineCacheEntry)) {
+    return false;
+  }
+
+  std::vector<TimelineCacheEntry> entries(header.count);
+  memcpy(entries.data(), content.data() + sizeof(header), header.count * sizeof(TimelineCacheEntry));
+  for (const auto &e : entries) {
+    if (e.type <= (int)TimelineType::None || e.type > (int)TimelineType::UserFlag) return false;
+  }
+  {
+    std::lock_guard lk(timeline_lock);
+    for (const auto &e : entries) {
+      timeline_.insert({e.begin, e.end, (TimelineType)e.type});
+    }
+  }
+  max_seconds_ = header.max_seconds;
+  emit minMaxTimeChanged(route_->segments().cbegin()->first * 60.0, max_seconds_);
+  rDebug("loaded %zu timeline entries from cache", entries.size());
+  return true;
+}
+
+void Replay::saveTimelineCache() {
+  std::vector<TimelineCacheEntry> entries;
+  for (const auto &[begin, end, type] : getTimeline()) {
+    entries.push_back({begin, end, (int32_t)type});
+  }
+  TimelineCacheHeader header = {};
+  memcpy(header.magic, TIMELINE_CACHE_MAGIC, sizeof(header.magic));
+  header.version = TIMELINE_CACHE_VERSION;
+  header.max_seconds = max_seconds_;
+  header.count = entries.size();
+
+  // write to a temporary file first, so a concurrent reader never sees a partial cache
+  const std::string file = timelineCacheFilePath();
+  const std::string tmp_file = file + "." + util::random_string(8) + ".tmp";
+  {
+    std::ofstream fs(tmp_file, std::ios::binary | std::ios::out);
+    fs.write((const char *)&header, sizeof(header));
+    fs.write((const char *)entries.data(), entries.size() * sizeof(TimelineCacheEntry));
+    if (!fs) {
+      fs.close();
+      ::remove(tmp_file.c_str());
+      return;
     }
-    emit qLogLoaded(log);
   }
+  ::rename(tmp_file.c_str(), file.c_str());
 }
 
 std::optional<uint64_t> Replay::find(FindFlag flag) {
@@ -271,14 +451,38 @@ void Replay::segmentLoadFinished(bool success) {
   updateSegmentsCache();
 }
 
+// swaps the rlog in for the qlog of a segment, while the stream thread is paused
+void Replay::segmentLogUpgraded(int seg_num) {
+  auto it = segments_.find(seg_num);
+  if (it == segments_.end() || !it->second) return;
+
+  rDebug("segment %d upgraded to rlog", seg_num);
+  if (stream_thread_ && isSegmentMerged(seg_num)) {
+    emit segmentsMerged();
+  }
+  std::unique_ptr<LogReader> qlog;
+  updateEvents([&]() {
+    const bool merged = events_.contains(seg_num);
+    if (merged) events_.erase(seg_num);
+    qlog = it->second->upgradeLog();
+    if (merged) events_.insert(seg_num, &it->second->log->events);
+    return !seeking_to_ && (isSegmentMerged(current_segment_) || (segments_.count(current_segment_) == 0));
+  });
+}
+
 void Replay::updateSegmentsCache() {
   auto cur = segments_.lower_bound(current_segment_.load());
   if (cur == segments_.end()) return;
 
   // Calculate the range of segments to load
-  auto begin = std::prev(cur, std::min<int>(segment_cache_limit / 2, std::distance(segments_.begin(), cur)));
-  auto end = std::next(begin, std::min<int>(segment_cache_limit, std::distance(begin, segments_.end())));
-  begin = std::prev(end, std::min<int>(segment_cache_limit, std::distance(segments_.begin(), end)));
+  SegmentMap::iterator begin, end;
+  if (cache_memory_budget_ > 0) {
+    std::tie(begin, end) = segmentRangeInBudget(cur);
+  } else {
+    begin = std::prev(cur, std::min<int>(segment_cache_limit / 2, std::distance(segments_.begin(), cur)));
+    end = std::next(begin, std::min<int>(segment_cache_limit, std::distance(begin, segments_.end())));
+    begin = std::prev(end, std::min<int>(segment_cache_limit, std::distance(segments_.begin(), end)));
+  }
 
   loadSegmentInRange(begin, cur, end);
   mergeSegments(begin, end);
@@ -294,58 +498,100 @@ void Replay::updateSegmentsCache() {
   }
 }
 
-void Replay::loadSegmentInRange(SegmentMap::iterator begin, SegmentMap::iterator cur, SegmentMap::iterator end) {
-  auto loadNextSegment = [this](auto first, auto last) {
-    auto it = std::find_if(first, last, [](const auto &seg_it) { return !seg_it.second || !seg_it.second->isLoaded(); });
-    if (it != last && !it->second) {
-      rDebug("loading segment %d...", it->first);
-      it->second = std::make_unique<Segment>(it->first, route_->at(it->first), flags_, filters_);
-      QObject::connect(it->second.get(), &Segment::loadFinished, this, &Replay::segmentLoadFinished);
-      return true;
+// Grows the window around cur while the segments fit in the memory budget, two segments
+// ahead of the playhead for each one behind it. The current segment is always included.
+std::pair<Replay::SegmentMap::iterator, Replay::SegmentMap::iterator> Replay::segmentRangeInBudget(SegmentMap::iterator cur) {
+  // segments that are not loaded yet are assumed to cost as much as the loaded ones on average
+  size_t loaded_usage = 0, loaded_count = 0;
+  for (const auto &[n, seg] : segments_) {
+    if (seg && seg->isLoaded()) {
+      loaded_usage += seg->memoryUsage();
+      ++loaded_count;
     }
-    return false;
+  }
+  const size_t estimate = loaded_count > 0 ? loaded_usage / loaded_count : SEGMENT_MEMORY_ESTIMATE;
+  auto usage = [estimate](SegmentMap::iterator it) {
+    return it->second && it->second->isLoaded() ? it->second->memoryUsage() : estimate;
   };
 
-  // Try loading forward segments, then reverse segments
-  if (!loadNextSegment(cur, end)) {
-    loadNextSegment(std::make_reverse_iterator(cur), std::make_reverse_iterator(begin));
+  const size_t budget = cache_memory_budget_;
+  auto begin = cur, end = std::next(cur);
+  size_t total = usage(cur);
+  bool grow_ahead = true, grow_behind = true;
+  for (int i = 0; grow_ahead || grow_behind; ++i) {
+    if (grow_ahead && (i % 3 != 2 || !grow_behind)) {
+      grow_ahead = end != segments_.end() && total + usage(end) <= budget;
+      if (grow_ahead) total += usage(end++);
+    } else {
+      grow_behind = begin != segments_.begin() && total + usage(std::prev(begin)) <= budget;
+      if (grow_behind) total += usage(--begin);
+    }
+  }
+  return {begin, end};
+}
+
+void Replay::setConcurrentLoads(int n) {
+  concurrent_loads_ = std::max(1, n);
+  // one thread for each file of a segment
+  load_pool_.setMaxThreadCount(concurrent_loads_ * (MAX_CAMERAS + 1));
+}
+
+// Starts loading the segments in [begin, end) nearest to cur until concurrent_loads_ segments are loading.
+// Segments ahead of the playhead go first at the same distance. Segments leaving the window after a seek
+// are freed by updateSegmentsCache, which aborts their loading.
+void Replay::loadSegmentInRange(SegmentMap::iterator begin, SegmentMap::iterator cur, SegmentMap::iterator end) {
+  int loading = 0;
+  std::vector<SegmentMap::iterator> pending;
+  for (auto it = begin; it != end; ++it) {
+    if (!it->second) {
+      pending.push_back(it);
+    } else if (!it->second->isLoaded()) {
+      ++loading;
+    }
+  }
+
+  auto priority = [n = cur->first](SegmentMap::iterator it) {
+    return it->first >= n ? (it->first - n) * 2 : (n - it->first) * 2 + 1;
+  };
+  std::sort(pending.begin(), pending.end(), [&](auto a, auto b) { return priority(a) < priority(b); });
+
+  for (auto it : pending) {
+    if (loading >= concurrent_loads_) break;
+    rDebug("loading segment %d...", it->first);
+    it->second = std::make_unique<Segment>(it->first, route_->at(it->first), flags_, &load_pool_, filters_);
+    QObject::connect(it->second.get(), &Segment::loadFinished, this, &Replay::segmentLoadFinished);
+    QObject::connect(it->second.get(), &Segment::logUpgraded, this, &Replay::segmentLogUpgraded);
+    ++loading;
   }
 }
 
 void Replay::mergeSegments(const SegmentMap::iterator &begin, const SegmentMap::iterator &end) {
   std::set<int> segments_to_merge;
-  size_t new_events_size = 0;
   for (auto it = begin; it != end; ++it) {
     if (it->second && it->second->isLoaded()) {
       segments_to_merge.insert(it->first);
-      new_events_size += it->second->log->events.size();
     }
   }
 
-  if (segments_to_merge == merged_segments_) return;
+  const std::set<int> merged_segments = events_.segments();
+  if (segments_to_merge == merged_segments) return;
 
   rDebug("merge segments %s", std::accumulate(segments_to_merge.begin(), segments_to_merge.end(), std::string{},
     [](auto & a, int b) { return a + (a.empty() ? "" : ", ") + std::to_string(b); }).c_str());
 
-  std::vector<Event> new_events;
-  new_events.reserve(new_events_size);
-
-  // Merge events from segments_to_merge into new_events
-  for (int n : segments_to_merge) {
-    size_t size = new_events.size();
-    const auto &events = segments_.at(n)->log->events;
-    std::copy_if(events.begin(), events.end(), std::back_inserter(new_events),
-                  [this](const Event &e) { return e.which < sockets_.size() && sockets_[e.which] != nullptr; });
-    std::inplace_merge(new_events.begin(), new_events.begin() + size, new_events.end());
-  }
-
   if (stream_thread_) {
     emit segmentsMerged();
   }
 
+  // Only the segments entering or leaving the window are touched, so the stream thread is paused only briefly.
+  // Events of services without a socket are skipped by the cursor.
   updateEvents([&]() {
-    events_.swap(new_events);
-    merged_segments_ = segments_to_merge;
+    for (int n : merged_segments) {
+      if (segments_to_merge.count(n) == 0) events_.erase(n);
+    }
+    for (int n : segments_to_merge) {
+      if (!events_.contains(n)) events_.insert(n, &segments_.at(n)->log->events);
+    }
     // Wake up the stream thread if the current segment is loaded or invalid.
     return !seeking_to_ && (isSegmentMerged(current_segment_) || (segments_.count(current_segment_) == 0));
   });
@@ -407,6 +653,23 @@ void Replay::startStream(const Segment *cur_segment) {
   emit streamStarted();
 }
 
+void Replay::waitForReaders(const char *socket) {
+  // msgq has no notification for readers catching up, so poll. A reader that keeps up is usually
+  // done within microseconds; the interval backs off for one that is slow, to not spin on a core.
+  const int timeout_ms = flow_control_timeout_ms_;
+  const uint64_t timeout_ts = nanos_since_boot() + timeout_ms * 1e6;
+  auto interval = std::chrono::microseconds(10);
+  while (!paused_ && !pm->all_readers_updated(socket)) {
+    // a reader that went away without unregistering must not stall the replay forever
+    if (timeout_ms > 0 && nanos_since_boot() > timeout_ts) {
+      rWarning("timed out waiting for the readers of %s", socket);
+      break;
+    }
+    std::this_thread::sleep_for(interval);
+    interval = std::min(interval * 2, std::chrono::microseconds(1000));
+  }
+}
+
 void Replay::publishMessage(const Event *e) {
   if (event_filter && event_filter(e, filter_opaque)) return;
 
@@ -418,12 +681,28 @@ void Replay::publishMessage(const Event *e) {
       sockets_[e->which] = nullptr;
     }
   } else {
-    capnp::FlatArrayMessageReader reader(e->data);
-    auto event = reader.getRoot<cereal::Event>();
-    sm->update_msgs(nanos_since_boot(), {{sockets_[e->which], event}});
+    // the batch is delivered before a service would repeat in it, which would overwrite its previous message
+    if (sm_batch_services_[e->which] || (!sm_batch_.empty() && e->mono_time - sm_batch_ts_ > SM_BATCH_WINDOW_NS)) {
+      flushMessages();
+    }
+    if (sm_batch_.empty()) {
+      sm_batch_ts_ = e->mono_time;
+    }
+    sm_batch_.emplace_back(e->which, e->data);
+    sm_batch_services_[e->which] = true;
   }
 }
 
+void Replay::flushMessages() {
+  if (sm_batch_.empty()) return;
+
+  sm->update_msgs(nanos_since_boot(), sm_batch_);
+  for (const auto &[which, _] : sm_batch_) {
+    sm_batch_services_[which] = false;
+  }
+  sm_batch_.clear();
+}
+
 void Replay::publishFrame(const Event *e) {
   CameraType cam;
   switch (e->which) {
@@ -439,7 +718,7 @@ void Replay::publishFrame(const Event *e) {
   if (isSegmentMerged(e->eidx_segnum)) {
     auto &segment = segments_.at(e->eidx_segnum);
     if (auto &frame = segment->frames[cam]; frame) {
-      camera_server_->pushFrame(cam, frame.get(), e);
+      camera_server_->pushFrame(cam, frame, e);
     }
   }
 }
@@ -454,22 +733,22 @@ void Replay::streamThread() {
     if (exit_) break;
 
     Event event(cur_which, cur_mono_time_, {});
-    auto first = std::upper_bound(events_.cbegin(), events_.cend(), event);
-    if (first == events_.cend()) {
+    auto cursor = events_.upperBound(event);
+    if (cursor.end()) {
       rInfo("waiting for events...");
       events_ready_ = false;
       continue;
     }
 
-    auto it = publishEvents(first, events_.cend());
+    publishEvents(cursor);
 
     // Ensure frames are sent before unlocking to prevent race conditions
     if (camera_server_) {
       camera_server_->waitForSent();
     }
 
-    if (it != events_.cend()) {
-      cur_which = it->which;
+    if (!cursor.end()) {
+      cur_which = cursor->which;
     } else if (!hasFlag(REPLAY_FLAG_NO_LOOP)) {
       // Check for loop end and restart if necessary
       int last_segment = segments_.rbegin()->first;
@@ -481,14 +760,13 @@ void Replay::streamThread() {
   }
 }
 
-std::vector<Event>::const_iterator Replay::publishEvents(std::vector<Event>::const_iterator first,
-                                                         std::vector<Event>::const_iterator last) {
+void Replay::publishEvents(MergedEvents::Cursor &cursor) {
   uint64_t evt_start_ts = cur_mono_time_;
   uint64_t loop_start_ts = nanos_since_boot();
   double prev_replay_speed = speed_;
 
-  for (; !paused_ && first != last; ++first) {
-    const Event &evt = *first;
+  for (; !paused_ && !cursor.end(); cursor.next()) {
+    const Event &evt = *cursor;
     int segment = toSeconds(evt.mono_time) / 60;
 
     if (current_segment_ != segment) {
@@ -497,21 +775,30 @@ std::vector<Event>::const_iterator Replay::publishEvents(std::vector<Event>::con
     }
 
      // Skip events if socket is not present
-    if (!sockets_[evt.which]) continue;
+    if (evt.which >= sockets_.size() || !sockets_[evt.which]) continue;
 
     cur_mono_time_ = evt.mono_time;
-    const uint64_t current_nanos = nanos_since_boot();
-    const int64_t time_diff = (evt.mono_time - evt_start_ts) / speed_ - (current_nanos - loop_start_ts);
-
-    // Reset timestamps for potential synchronization issues:
-    // - A negative time_diff may indicate slow execution or system wake-up,
-    // - A time_diff exceeding 1 second suggests a skipped segment.
-    if ((time_diff < -1e9 || time_diff >= 1e9) || speed_ != prev_replay_speed) {
-      evt_start_ts = evt.mono_time;
-      loop_start_ts = current_nanos;
-      prev_replay_speed = speed_;
-    } else if (time_diff > 0) {
-      precise_nano_sleep(time_diff, paused_);
+    const bool flow_control = hasFlag(REPLAY_FLAG_FLOW_CONTROL);
+    if (flow_control) {
+      // Not paced by the clock: wait until the previous message on this socket has been read.
+      if (sm == nullptr && evt.eidx_segnum == -1) {
+        waitForReaders(sockets_[evt.which]);
+      }
+    } else {
+      const uint64_t current_nanos = nanos_since_boot();
+      const int64_t time_diff = (evt.mono_time - evt_start_ts) / speed_ - (current_nanos - loop_start_ts);
+
+      // Reset timestamps for potential synchronization issues:
+      // - A negative time_diff may indicate slow execution or system wake-up,
+      // - A time_diff exceeding 1 second suggests a skipped segment.
+      if ((time_diff < -1e9 || time_diff >= 1e9) || speed_ != prev_replay_speed) {
+        evt_start_ts = evt.mono_time;
+        loop_start_ts = current_nanos;
+        prev_replay_speed = speed_;
+      } else if (time_diff > 0) {
+        flushMessages();
+        precise_nano_sleep(time_diff, paused_);
+      }
     }
 
     if (paused_) break;
@@ -519,12 +806,12 @@ std::vector<Event>::const_iterator Replay::publishEvents(std::vector<Event>::con
     if (evt.eidx_segnum == -1) {
       publishMessage(&evt);
     } else if (camera_server_) {
-      if (speed_ > 1.0) {
+      // pushFrame blocks while the camera is behind, flow control also keeps the frames in order with the other messages
+      if (flow_control) {
         camera_server_->waitForSent();
       }
       publishFrame(&evt);
     }
   }
-
-  return first;
+  flushMessages();
 }
@@ -13,12 +13,17 @@
 #include <QThread>
 
 #include "tools/replay/camera.h"
+#include "tools/replay/mergedevents.h"
 #include "tools/replay/route.h"
 
 const QString DEMO_ROUTE = "a2a0ccea32023010|2023-07-27--13-01-19";
 
-// one segment uses about 100M of memory
+// one segment uses about 100M of memory (local uncompressed logs are memory mapped instead)
 constexpr int MIN_SEGMENTS_CACHE = 5;
+constexpr size_t SEGMENT_MEMORY_ESTIMATE = 100 * 1024 * 1024;
+constexpr int DEFAULT_CONCURRENT_LOADS = 2;
+// how long to wait for the readers of a socket in flow control mode
+constexpr int DEFAULT_FLOW_CONTROL_TIMEOUT_MS = 1000;
 
 enum REPLAY_FLAGS {
   REPLAY_FLAG_NONE = 0x0000,
@@ -30,6 +35,9 @@ enum REPLAY_FLAGS {
   REPLAY_FLAG_NO_HW_DECODER = 0x0100,
   REPLAY_FLAG_NO_VIPC = 0x0400,
   REPLAY_FLAG_ALL_SERVICES = 0x0800,
+  REPLAY_FLAG_FLOW_CONTROL = 0x1000,
+  REPLAY_FLAG_ZSTD_CACHE = 0x2000,
+  REPLAY_FLAG_PROGRESSIVE = 0x4000,
 };
 
 enum class FindFlag {
@@ -42,6 +50,11 @@ enum class FindFlag {
 };
 
 enum class TimelineType { None, Engaged, AlertInfo, AlertWarning, AlertCritical, UserFlag };
+struct TimelineCompare {
+  bool operator()(const std::tuple<double, double, TimelineType> &l, const std::tuple<double, double, TimelineType> &r) const {
+    return std::tie(std::get<2>(l), std::get<0>(l), std::get<1>(l)) < std::tie(std::get<2>(r), std::get<0>(r), std::get<1>(r));
+  }
+};
 typedef bool (*replayEventFilter)(const Event *, void *);
 Q_DECLARE_METATYPE(std::shared_ptr<LogReader>);
 
@@ -69,6 +82,14 @@ public:
   }
   inline int segmentCacheLimit() const { return segment_cache_limit; }
   inline void setSegmentCacheLimit(int n) { segment_cache_limit = std::max(MIN_SEGMENTS_CACHE, n); }
+  // if set, the cache keeps as many segments as fit in bytes instead of a fixed number of segments
+  inline void setCacheMemoryBudget(size_t bytes) { cache_memory_budget_ = bytes; }
+  inline size_t cacheMemoryBudget() const { return cache_memory_budget_; }
+  // number of segments loaded at the same time, nearest to the playhead first
+  void setConcurrentLoads(int n);
+  inline int concurrentLoads() const { return concurrent_loads_; }
+  // in flow control mode, give up waiting for the readers of a socket after ms. 0 waits as long as it takes
+  inline void setFlowControlTimeout(int ms) { flow_control_timeout_ms_ = std::max(0, ms); }
   inline bool hasFlag(REPLAY_FLAGS flag) const { return flags_ & flag; }
   inline void addFlag(REPLAY_FLAGS flag) { flags_ |= flag; }
   inline void removeFlag(REPLAY_FLAGS flag) { flags_ &= ~flag; }
@@ -82,12 +103,14 @@ public:
   inline double maxSeconds() const { return max_seconds_; }
   inline void setSpeed(float speed) { speed_ = speed; }
   inline float getSpeed() const { return speed_; }
-  inline const std::vector<Event> *events() const { return &events_; }
+  inline const MergedEvents *events() const { return &events_; }
   inline const std::map<int, std::unique_ptr<Segment>> &segments() const { return segments_; }
   inline const std::string &carFingerprint() const { return car_fingerprint_; }
+  // frame latencies of the camera, empty without the camera server
+  inline CameraStats cameraStats(CameraType type) const { return camera_server_ ? camera_server_->stats(type) : CameraStats{}; }
   inline const std::vector<std::tuple<double, double, TimelineType>> getTimeline() {
     std::lock_guard lk(timeline_lock);
-    return timeline_;
+    return {timeline_.begin(), timeline_.end()};
   }
 
 signals:
@@ -100,6 +123,7 @@ signals:
 
 protected slots:
   void segmentLoadFinished(bool success);
+  void segmentLogUpgraded(int seg_num);
 
 protected:
   typedef std::map<int, std::unique_ptr<Segment>> SegmentMap;
@@ -108,16 +132,21 @@ protected:
   void startStream(const Segment *cur_segment);
   void streamThread();
   void updateSegmentsCache();
+  std::pair<SegmentMap::iterator, SegmentMap::iterator> segmentRangeInBudget(SegmentMap::iterator cur);
   void loadSegmentInRange(SegmentMap::iterator begin, SegmentMap::iterator cur, SegmentMap::iterator end);
   void mergeSegments(const SegmentMap::iterator &begin, const SegmentMap::iterator &end);
   void updateEvents(const std::function<bool()>& update_events_function);
-  std::vector<Event>::const_iterator publishEvents(std::vector<Event>::const_iterator first,
-                                                   std::vector<Event>::const_iterator last);
+  void publishEvents(MergedEvents::Cursor &cursor);
+  void waitForReaders(const char *socket);
   void publishMessage(const Event *e);
+  void flushMessages();
   void publishFrame(const Event *e);
   void buildTimeline();
+  std::string timelineCacheFilePath() const;
+  bool loadTimelineCache();
+  void saveTimelineCache();
   void checkSeekProgress();
-  inline bool isSegmentMerged(int n) const { return merged_segments_.count(n) > 0; }
+  inline bool isSegmentMerged(int n) const { return events_.contains(n); }
 
   pthread_t stream_thread_id = 0;
   QThread *stream_thread_ = nullptr;
@@ -126,6 +155,8 @@ protected:
   std::condition_variable stream_cv_;
   std::atomic<int> current_segment_ = 0;
   std::optional<double> seeking_to_;
+  // the segments of this replay are loaded here, declared before segments_ so it outlives them
+  QThreadPool load_pool_;
   SegmentMap segments_;
   // the following variables must be protected with stream_lock_
   std::atomic<bool> exit_ = false;
@@ -135,11 +166,14 @@ protected:
   uint64_t route_start_ts_ = 0;
   std::atomic<uint64_t> cur_mono_time_ = 0;
   std::atomic<double> max_seconds_ = 0;
-  std::vector<Event> events_;
-  std::set<int> merged_segments_;
+  MergedEvents events_;
 
   // messaging
   SubMaster *sm = nullptr;
+  // events for sm, delivered in one update_msgs call per batch. only used by the stream thread.
+  std::vector<std::pair<cereal::Event::Which, kj::ArrayPtr<const capnp::word>>> sm_batch_;
+  std::vector<bool> sm_batch_services_;  // services in sm_batch_, by Event::Which
+  uint64_t sm_batch_ts_ = 0;             // mono time of the first event of sm_batch_
   std::unique_ptr<PubMaster> pm;
   std::vector<const char*> sockets_;
   std::vector<bool> filters_;
@@ -149,10 +183,14 @@ protected:
 
   std::mutex timeline_lock;
   QFuture<void> timeline_future;
-  std::vector<std::tuple<double, double, TimelineType>> timeline_;
+  // ordered by type, then by time
+  std::multiset<std::tuple<double, double, TimelineType>, TimelineCompare> timeline_;
   std::string car_fingerprint_;
   std::atomic<float> speed_ = 1.0;
   replayEventFilter event_filter = nullptr;
   void *filter_opaque = nullptr;
   int segment_cache_limit = MIN_SEGMENTS_CACHE;
+  std::atomic<size_t> cache_memory_budget_ = 0;
+  int concurrent_loads_ = DEFAULT_CONCURRENT_LOADS;
+  std::atomic<int> flow_control_timeout_ms_ = DEFAULT_FLOW_CONTROL_TIMEOUT_MS;
 };
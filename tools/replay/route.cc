@@ -139,19 +139,25 @@ void Route::addFileToSegment(int n, const QString &file) {
 
 // class Segment
 
-Segment::Segment(int n, const SegmentFile &files, uint32_t flags, const std::vector<bool> &filters)
+Segment::Segment(int n, const SegmentFile &files, uint32_t flags, QThreadPool *pool, const std::vector<bool> &filters)
     : seg_num(n), flags(flags), filters_(filters) {
   // [RoadCam, DriverCam, WideRoadCam, log]. fallback to qcamera/qlog
   const std::array file_list = {
       (flags & REPLAY_FLAG_QCAMERA) || files.road_cam.isEmpty() ? files.qcamera : files.road_cam,
       flags & REPLAY_FLAG_DCAM ? files.driver_cam : "",
       flags & REPLAY_FLAG_ECAM ? files.wide_road_cam : "",
-      files.rlog.isEmpty() ? files.qlog : files.rlog,
+      files.rlog.isEmpty() || ((flags & REPLAY_FLAG_PROGRESSIVE) && !files.qlog.isEmpty()) ? files.qlog : files.rlog,
   };
+  if ((flags & REPLAY_FLAG_PROGRESSIVE) && !files.qlog.isEmpty() && !files.rlog.isEmpty()) {
+    upgrade_file_ = files.rlog.toStdString();
+  }
+  for (int i = 0; i < MAX_CAMERAS; ++i) {
+    hevc_[i] = util::ends_with(getUrlWithoutQuery(file_list[i].toStdString()), ".hevc");
+  }
   for (int i = 0; i < file_list.size(); ++i) {
     if (!file_list[i].isEmpty() && (!(flags & REPLAY_FLAG_NO_VIPC) || i >= MAX_CAMERAS)) {
       ++loading_;
-      synchronizer_.addFuture(QtConcurrent::run(this, &Segment::loadFile, i, file_list[i].toStdString()));
+      synchronizer_.addFuture(QtConcurrent::run(pool, this, &Segment::loadFile, i, file_list[i].toStdString()));
     }
   }
 }
@@ -163,15 +169,43 @@ Segment::~Segment() {
   synchronizer_.waitForFinished();
 }
 
+size_t Segment::memoryUsage() const {
+  size_t usage = log ? log->memoryUsage() : 0;
+  for (const auto &fr : frames) {
+    if (fr) usage += fr->memoryUsage();
+  }
+  return usage;
+}
+
 void Segment::loadFile(int id, const std::string file) {
   const bool local_cache = !(flags & REPLAY_FLAG_NO_FILE_CACHE);
   bool success = false;
   if (id < MAX_CAMERAS) {
-    frames[id] = std::make_unique<FrameReader>();
-    success = frames[id]->load((CameraType)id, file, flags & REPLAY_FLAG_NO_HW_DECODER, &abort_, local_cache, 20 * 1024 * 1024, 3);
+    frames[id] = std::make_shared<FrameReader>();
+    success = frames[id]->open((CameraType)id, file, flags & REPLAY_FLAG_NO_HW_DECODER, &abort_, local_cache, 20 * 1024 * 1024, 3);
+    if (success) {
+      std::unique_lock lk(index_lock_);
+      if (log_loaded_) {
+        lk.unlock();
+        success = indexFrames(id);
+      } else {
+        unindexed_cameras_.push_back(id);
+      }
+    }
   } else {
     log = std::make_unique<LogReader>(filters_);
+    log->setCacheAsZstd(flags & REPLAY_FLAG_ZSTD_CACHE);
     success = log->load(file, &abort_, local_cache, 0, 3);
+
+    std::vector<int> cameras;
+    {
+      std::lock_guard lk(index_lock_);
+      log_loaded_ = true;
+      cameras.swap(unindexed_cameras_);
+    }
+    for (int cam : cameras) {
+      success = success && indexFrames(cam);
+    }
   }
 
   if (!success) {
@@ -182,4 +216,53 @@ void Segment::loadFile(int id, const std::string file) {
   if (--loading_ == 0) {
     emit loadFinished(!abort_);
   }
+
+  if (id == MAX_CAMERAS && success && !upgrade_file_.empty()) {
+    loadUpgradeLog(local_cache);
+  }
+}
+
+// Progressive loading: the qlog is played while the rlog is loaded, which then replaces it.
+// A failed rlog only costs the upgrade, the segment keeps playing the qlog.
+void Segment::loadUpgradeLog(bool local_cache) {
+  auto rlog = std::make_unique<LogReader>(filters_);
+  rlog->setCacheAsZstd(flags & REPLAY_FLAG_ZSTD_CACHE);
+  if (!rlog->load(upgrade_file_, &abort_, local_cache, 0, 3)) {
+    if (!abort_) rWarning("failed to load the rlog of segment %d, keep playing its qlog", seg_num);
+    return;
+  }
+  if (!abort_) {
+    upgraded_log_ = std::move(rlog);
+    emit logUpgraded(seg_num);
+  }
+}
+
+bool Segment::indexFrames(int cam) {
+  static const cereal::Event::Which encode_idx[] = {
+      cereal::Event::ROAD_ENCODE_IDX, cereal::Event::DRIVER_ENCODE_IDX, cereal::Event::WIDE_ROAD_ENCODE_IDX};
+  std::vector<EncodeIdxPacket> packets;
+  if (hevc_[cam] && log) {
+    for (size_t i = 0; i < log->events.size(); ++i) {
+      if (log->events.which(i) != encode_idx[cam]) continue;
+
+      const Event e = log->events[i];
+      if (e.eidx_segnum != -1) continue;  // the copy of the event added for the video stream
+
+      capnp::FlatArrayMessageReader reader(e.data);
+      auto event = reader.getRoot<cereal::Event>();
+      auto idx = capnp::AnyStruct::Reader(event).getPointerSection()[0].getAs<cereal::EncodeIndex>();
+      // frames at the end of a segment may be logged in the next one
+      if (idx.getType() == cereal::EncodeIndex::Type::FULL_H_E_V_C && idx.getSegmentNum() == seg_num) {
+        packets.push_back({idx.getSegmentIdEncode(), idx.getFlags(), idx.getLen()});
+      }
+    }
+  }
+  return frames[cam]->buildPacketIndex(packets, &abort_);
+}
+
+std::unique_ptr<LogReader> Segment::upgradeLog() {
+  if (upgraded_log_) {
+    std::swap(log, upgraded_log_);
+  }
+  return std::move(upgraded_log_);
 }
@@ -7,6 +7,7 @@
 
 #include <QDateTime>
 #include <QFutureSynchronizer>
+#include <QThreadPool>
 
 #include "tools/replay/framereader.h"
 #include "tools/replay/logreader.h"
@@ -66,23 +67,43 @@ class Segment : public QObject {
   Q_OBJECT
 
 public:
-  Segment(int n, const SegmentFile &files, uint32_t flags, const std::vector<bool> &filters = {});
+  // the files are loaded on pool, which must outlive the segment
+  Segment(int n, const SegmentFile &files, uint32_t flags, QThreadPool *pool, const std::vector<bool> &filters = {});
   ~Segment();
   inline bool isLoaded() const { return !loading_ && !abort_; }
+  // bytes held by the loaded log and frame readers. only valid once loaded.
+  size_t memoryUsage() const;
+  // replaces the qlog with the rlog once it is loaded in progressive mode, returns the qlog.
+  // must not be called while the events of log are in use.
+  std::unique_ptr<LogReader> upgradeLog();
 
   const int seg_num = 0;
   std::unique_ptr<LogReader> log;
-  std::unique_ptr<FrameReader> frames[MAX_CAMERAS] = {};
+  // shared with the camera server, which may still be decoding ahead when the segment is freed
+  std::shared_ptr<FrameReader> frames[MAX_CAMERAS] = {};
 
 signals:
   void loadFinished(bool success);
+  // the rlog is ready to replace the qlog, see upgradeLog()
+  void logUpgraded(int seg_num);
 
 protected:
   void loadFile(int id, const std::string file);
+  void loadUpgradeLog(bool local_cache);
+  bool indexFrames(int cam);
 
   std::atomic<bool> abort_ = false;
   std::atomic<int> loading_ = 0;
   QFutureSynchronizer<void> synchronizer_;
   uint32_t flags;
   std::vector<bool> filters_;
+  std::string upgrade_file_;
+  std::unique_ptr<LogReader> upgraded_log_;
+
+  // the packets of the raw hevc videos are indexed from the encodeIdx events of the log,
+  // by whichever of the video and the log finishes loading last
+  bool hevc_[MAX_CAMERAS] = {};
+  std::mutex index_lock_;
+  bool log_loaded_ = false;
+  std::vector<int> unindexed_cameras_;
 };
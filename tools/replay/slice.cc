@@ -0,0 +1,329 @@
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QThreadPool>
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <thread>
+
+#include "common/util.h"
+#include "tools/replay/framereader.h"
+#include "tools/replay/logreader.h"
+#include "tools/replay/route.h"
+#include "tools/replay/util.h"
+
+// Writes a time window of a route as a new local route, which replay loads with --data_dir.
+// The rlog of each segment keeps the selected services and is compressed as seekable zstd.
+// The hevc videos are cut at the key frame before the window, without re-encoding, and the
+// encodeIdx events of the copied packets are renumbered to match.
+
+namespace {
+
+const cereal::Event::Which ENCODE_IDX[MAX_CAMERAS] = {
+    cereal::Event::ROAD_ENCODE_IDX, cereal::Event::DRIVER_ENCODE_IDX, cereal::Event::WIDE_ROAD_ENCODE_IDX};
+const char *VIDEO_FILES[MAX_CAMERAS] = {"fcamera.hevc", "dcamera.hevc", "ecamera.hevc"};
+
+struct SliceOptions {
+  uint64_t begin_ts = 0;  // mono time of the window
+  uint64_t end_ts = std::numeric_limits<uint64_t>::max();
+  std::vector<bool> services;  // by Event::Which
+  bool cameras[MAX_CAMERAS] = {};
+  std::string output_dir;
+  std::string timestamp;  // of the route, names the segment directories
+  int level = 3;
+  int compress_threads = 1;
+};
+
+// local files are mapped, remote ones are read through the download cache
+class SourceFile {
+public:
+  SourceFile(const std::string &url, size_t chunk_size, std::atomic<bool> *abort) {
+    if (url.find("https://") != 0) {
+      mapped_ = std::make_unique<MappedFile>(url);
+      data_ = mapped_->data();
+      size_ = mapped_->size();
+    } else {
+      content_ = FileReader(true, chunk_size, 3).read(url, abort);
+      data_ = content_.data();
+      size_ = content_.size();
+    }
+  }
+  inline const char *data() const { return size_ > 0 ? data_ : nullptr; }
+  inline size_t size() const { return size_; }
+
+private:
+  std::unique_ptr<MappedFile> mapped_;
+  std::string content_;
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// an encodeIdx event of a video to copy
+struct VideoPacket {
+  EncodeIdxPacket packet;
+  uint32_t segment_id;
+  uint64_t mono_time;
+  size_t event;  // index in the events of the log
+};
+
+// segments known to lie outside the window, the logs of a route are in time order
+struct SegmentBounds {
+  std::atomic<int> before_begin = std::numeric_limits<int>::min();
+  std::atomic<int> after_end = std::numeric_limits<int>::max();
+};
+
+// Copies the packets of the video from the key frame before the window to the last frame in it.
+// Sets first and last to the indexes of the first and last copied packets, first is -1 if no
+// packet is in the window. Returns false if the video couldn't be copied.
+bool copyVideo(const std::string &url, const std::string &file, const std::vector<VideoPacket> &packets,
+               const SliceOptions &opts, int &first, int &last, std::atomic<bool> *abort) {
+  first = last = -1;
+  auto begin = std::find_if(packets.begin(), packets.end(), [&](auto &p) { return p.mono_time >= opts.begin_ts; });
+  auto end = std::find_if(begin, packets.end(), [&](auto &p) { return p.mono_time >= opts.end_ts; });
+  if (begin == end) return true;
+
+  int key = begin - packets.begin();
+  while (key > 0 && !(packets[key].packet.flags & ENCODE_IDX_FLAG_KEYFRAME)) --key;
+
+  SourceFile video(url, 20 * 1024 * 1024, abort);
+  std::vector<EncodeIdxPacket> index;
+  for (const auto &p : packets) index.push_back(p.packet);
+  std::vector<int64_t> positions;
+  const int64_t header_size = locateEncodeIdxPackets(video.data(), video.size(), index, positions);
+  if (header_size < 0) {
+    rError("encodeIdx events don't match %s", url.c_str());
+    return false;
+  }
+
+  const int end_index = (end - packets.begin()) - 1;
+  std::ofstream fs(file, std::ios::binary | std::ios::out | std::ios::trunc);
+  fs.write(video.data(), header_size);
+  fs.write(video.data() + positions[key], positions[end_index] + packets[end_index].packet.len - positions[key]);
+  if (!fs) {
+    rError("failed to write %s", file.c_str());
+    fs.close();
+    ::remove(file.c_str());
+    return false;
+  }
+  first = key;
+  last = end_index;
+  return true;
+}
+
+// Returns false if the segment couldn't be sliced. A segment whose log is entirely outside
+// the window is not written, and is recorded in bounds.
+bool sliceSegment(int seg_num, const SegmentFile &files, const SliceOptions &opts, SegmentBounds &bounds,
+                  std::atomic<int> &sliced, std::atomic<bool> *abort) {
+  const std::string log_url = (files.rlog.isEmpty() ? files.qlog : files.rlog).toStdString();
+  LogReader log;
+  if (!log.load(log_url, abort, true, 0, 3)) {
+    rError("failed to load the log of segment %d", seg_num);
+    return false;
+  }
+  if (log.events.empty()) return true;
+
+  if (log.events.back().mono_time < opts.begin_ts) {
+    for (int n = bounds.before_begin; n < seg_num && !bounds.before_begin.compare_exchange_weak(n, seg_num);) {}
+    return true;
+  }
+  if (log.events.front().mono_time >= opts.end_ts) {
+    for (int n = bounds.after_end; n > seg_num && !bounds.after_end.compare_exchange_weak(n, seg_num);) {}
+    return true;
+  }
+
+  const QString videos[MAX_CAMERAS] = {files.road_cam, files.driver_cam, files.wide_road_cam};
+  std::vector<VideoPacket> packets[MAX_CAMERAS];
+  size_t window_events = 0;
+  for (size_t i = 0; i < log.events.size(); ++i) {
+    const Event e = log.events[i];
+    if (e.eidx_segnum != -1) continue;  // the copy of an encodeIdx event added for the video stream
+
+    window_events += e.mono_time >= opts.begin_ts && e.mono_time < opts.end_ts;
+    for (int cam = 0; cam < MAX_CAMERAS; ++cam) {
+      if (e.which != ENCODE_IDX[cam] || !opts.cameras[cam] || videos[cam].isEmpty()) continue;
+
+      capnp::FlatArrayMessageReader reader(e.data);
+      auto event = reader.getRoot<cereal::Event>();
+      auto idx = capnp::AnyStruct::Reader(event).getPointerSection()[0].getAs<cereal::EncodeIndex>();
+      if (idx.getType() == cereal::EncodeIndex::Type::FULL_H_E_V_C && idx.getSegmentNum() == seg_num) {
+        packets[cam].push_back({{idx.getSegmentIdEncode(), idx.getFlags(), idx.getLen()}, idx.getSegmentId(), e.mono_time, i});
+      }
+    }
+  }
+  if (window_events == 0) return true;
+
+  const std::string dir = util::string_format("%s/%s--%d", opts.output_dir.c_str(), opts.timestamp.c_str(), seg_num);
+  if (!util::create_directories(dir, 0755)) {
+    rError("failed to create %s", dir.c_str());
+    return false;
+  }
+
+  // encodeIdx events of the copied packets by event index: camera and the new segment ids
+  std::map<size_t, std::tuple<int, uint32_t, uint32_t>> renumbered;
+  bool copied_video[MAX_CAMERAS] = {};
+  bool success = true;
+  for (int cam = 0; cam < MAX_CAMERAS; ++cam) {
+    auto &p = packets[cam];
+    if (p.empty()) continue;
+
+    std::sort(p.begin(), p.end(), [](auto &l, auto &r) { return l.packet.segment_id_encode < r.packet.segment_id_encode; });
+    int first = -1, last = -1;
+    if (!copyVideo(videos[cam].toStdString(), dir + "/" + VIDEO_FILES[cam], p, opts, first, last, abort)) {
+      // the log is still written, with the encodeIdx events of the video as they are
+      rError("failed to copy %s of segment %d", VIDEO_FILES[cam], seg_num);
+      success = false;
+      continue;
+    }
+    copied_video[cam] = first >= 0;
+    for (int i = first; first >= 0 && i <= last; ++i) {
+      renumbered[p[i].event] = {cam, p[i].packet.segment_id_encode - p[first].packet.segment_id_encode,
+                                p[i].segment_id - p[first].segment_id};
+    }
+  }
+
+  SeekableZstdWriter writer(4 * 1024 * 1024, opts.level, opts.compress_threads);
+  for (size_t i = 0; i < log.events.size() && !(abort && *abort); ++i) {
+    const Event e = log.events[i];
+    if (e.eidx_segnum != -1) continue;
+
+    const bool of_copied_video = (e.which == ENCODE_IDX[RoadCam] && copied_video[RoadCam]) ||
+                                 (e.which == ENCODE_IDX[DriverCam] && copied_video[DriverCam]) ||
+                                 (e.which == ENCODE_IDX[WideRoadCam] && copied_video[WideRoadCam]);
+    if (of_copied_video) {
+      // the frames of a copied video are kept as they are in the new video, including the ones before the window
+      auto it = renumbered.find(i);
+      if (it == renumbered.end()) continue;
+
+      auto [cam, segment_id_encode, segment_id] = it->second;
+      capnp::FlatArrayMessageReader reader(e.data);
+      capnp::MallocMessageBuilder builder;
+      builder.setRoot(reader.getRoot<cereal::Event>());
+      auto event = builder.getRoot<cereal::Event>();
+      auto idx = cam == RoadCam ? event.getRoadEncodeIdx() : cam == DriverCam ? event.getDriverEncodeIdx() : event.getWideRoadEncodeIdx();
+      idx.setSegmentIdEncode(segment_id_encode);
+      idx.setSegmentId(segment_id);
+      auto words = capnp::messageToFlatArray(builder);
+      writer.write(words.asChars().begin(), words.asChars().size());
+    } else if (e.which < opts.services.size() && opts.services[e.which] &&
+               ((e.mono_time >= opts.begin_ts && e.mono_time < opts.end_ts) ||
+                e.which == cereal::Event::INIT_DATA || e.which == cereal::Event::CAR_PARAMS)) {
+      writer.write((const char *)e.data.begin(), e.data.size() * sizeof(capnp::word));
+    }
+  }
+
+  const std::string compressed = writer.finish();
+  if (compressed.empty() || (abort && *abort)) {
+    rError("failed to compress the log of segment %d", seg_num);
+    return false;
+  }
+  if (util::write_file((dir + "/rlog.zst").c_str(), compressed.data(), compressed.size(), O_WRONLY | O_CREAT | O_TRUNC) != 0) {
+    rError("failed to write the log of segment %d", seg_num);
+    return false;
+  }
+  ++sliced;
+  return success;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Write a time window of a route as a new local route.");
+  parser.addHelpOption();
+  parser.addPositionalArgument("route", "the route to slice");
+  parser.addOption({{"o", "output"}, "directory to write the route to, replay it with --data_dir <dir>", "dir"});
+  parser.addOption({"data_dir", "local directory with routes", "data_dir"});
+  parser.addOption({{"s", "start"}, "start from <seconds>. default is the beginning of the route", "seconds"});
+  parser.addOption({{"e", "end"}, "end at <seconds>. default is the end of the route", "seconds"});
+  parser.addOption({{"a", "allow"}, "whitelist of services to write", "allow"});
+  parser.addOption({{"b", "block"}, "blacklist of services to write", "block"});
+  parser.addOption({"fcam", "copy the road camera video"});
+  parser.addOption({"dcam", "copy the driver camera video"});
+  parser.addOption({"ecam", "copy the wide road camera video"});
+  parser.addOption({{"j", "jobs"}, "slice <n> segments at the same time. default is 2", "n", "2"});
+  parser.addOption({"level", "zstd compression level. default is 3", "level", "3"});
+  parser.process(app);
+
+  const QStringList args = parser.positionalArguments();
+  if (args.empty() || parser.value("output").isEmpty()) {
+    parser.showHelp();
+  }
+  QStringList allow = parser.value("allow").isEmpty() ? QStringList{} : parser.value("allow").split(",");
+  QStringList block = parser.value("block").isEmpty() ? QStringList{} : parser.value("block").split(",");
+
+  Route route(args.first(), parser.value("data_dir"));
+  if (!route.load()) {
+    fprintf(stderr, "failed to load route %s\n", qPrintable(args.first()));
+    return 1;
+  }
+
+  // times are relative to the first event of the route, as in replay
+  LogReader first_log;
+  const auto &first_files = route.segments().begin()->second;
+  if (!first_log.load((first_files.rlog.isEmpty() ? first_files.qlog : first_files.rlog).toStdString(), nullptr, true, 0, 3) ||
+      first_log.events.empty()) {
+    fprintf(stderr, "failed to load the first segment of %s\n", qPrintable(args.first()));
+    return 1;
+  }
+  const uint64_t route_start_ts = first_log.events.front().mono_time;
+
+  SliceOptions opts;
+  const double start = std::max(0.0, parser.value("start").toDouble());
+  const double end = parser.value("end").isEmpty() ? std::numeric_limits<double>::max() : parser.value("end").toDouble();
+  opts.begin_ts = route_start_ts + start * 1e9;
+  if (end < std::numeric_limits<double>::max()) {
+    opts.end_ts = route_start_ts + end * 1e9;
+  }
+  auto event_struct = capnp::Schema::from<cereal::Event>().asStruct();
+  for (auto field : event_struct.getUnionFields()) {
+    QString name = field.getProto().getName().cStr();
+    opts.services.push_back(!block.contains(name) && (allow.empty() || allow.contains(name)));
+  }
+  opts.cameras[RoadCam] = parser.isSet("fcam");
+  opts.cameras[DriverCam] = parser.isSet("dcam");
+  opts.cameras[WideRoadCam] = parser.isSet("ecam");
+  opts.output_dir = parser.value("output").toStdString();
+  opts.timestamp = route.identifier().timestamp.toStdString();
+  opts.level = parser.value("level").toInt();
+  const int jobs = std::max(1, parser.value("jobs").toInt());
+  opts.compress_threads = std::max(1, (int)std::thread::hardware_concurrency() / jobs);
+
+  // Segments are selected by the time range of their logs, not by their number, as a segment isn't
+  // exactly a minute long. They are tried starting at the one the window likely starts in, upwards and
+  // then downwards, so the first segments found outside the window skip loading the rest of the route.
+  std::vector<int> order;
+  for (const auto &[n, _] : route.segments()) order.push_back(n);
+  const int start_segment = start / 60;
+  std::stable_partition(order.begin(), order.end(), [=](int n) { return n >= start_segment; });
+  std::reverse(std::find_if(order.begin(), order.end(), [=](int n) { return n < start_segment; }), order.end());
+
+  QThreadPool pool;
+  pool.setMaxThreadCount(jobs);
+  std::atomic<bool> abort = false;
+  SegmentBounds bounds;
+  std::atomic<int> sliced = 0;
+  std::vector<std::pair<int, QFuture<bool>>> results;
+  for (int n : order) {
+    results.emplace_back(n, QtConcurrent::run(&pool, [&, n = n, files = route.segments().at(n)]() {
+      if (n <= bounds.before_begin || n >= bounds.after_end) return true;
+      return sliceSegment(n, files, opts, bounds, sliced, &abort);
+    }));
+  }
+
+  int failed = 0;
+  for (auto &[n, result] : results) {
+    if (!result.result()) {
+      fprintf(stderr, "failed to slice segment %d\n", n);
+      ++failed;
+    }
+  }
+  printf("sliced %d segments of %s into %s\n", sliced.load(), qPrintable(route.name()), opts.output_dir.c_str());
+  return failed == 0 ? 0 : 1;
+}
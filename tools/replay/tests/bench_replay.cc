@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <numeric>
+#include <vector>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QEventLoop>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#include "common/timing.h"
+#include "common/util.h"
+#include "tools/replay/replay.h"
+
+// Benchmarks replay against a local route and prints the results as JSON.
+// Files are read without the local cache, so every iteration does the same work.
+
+namespace {
+
+QJsonObject stats(std::vector<double> samples) {
+  std::sort(samples.begin(), samples.end());
+  QJsonObject obj;
+  if (!samples.empty()) {
+    obj["mean"] = std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+    obj["median"] = samples[samples.size() / 2];
+    obj["min"] = samples.front();
+    obj["max"] = samples.back();
+  }
+  return obj;
+}
+
+// runs f iterations times, returns the elapsed time of each run in ms
+std::vector<double> measure(int iterations, const std::function<void()> &f) {
+  std::vector<double> samples;
+  for (int i = 0; i < iterations; ++i) {
+    double start = millis_since_boot();
+    f();
+    samples.push_back(millis_since_boot() - start);
+  }
+  return samples;
+}
+
+class BenchReplay : public Replay {
+public:
+  using Replay::Replay;
+
+  bool loadSegments(int count) {
+    for (auto it = segments_.begin(); it != segments_.end() && count-- > 0; ++it) {
+      QEventLoop loop;
+      it->second = std::make_unique<Segment>(it->first, route_->at(it->first), flags_, &load_pool_, filters_);
+      QObject::connect(it->second.get(), &Segment::loadFinished, &loop, &QEventLoop::quit);
+      if (!it->second->isLoaded()) loop.exec();
+      if (!it->second->isLoaded()) return false;
+    }
+    return true;
+  }
+
+  QJsonObject benchMerge(int count, int iterations) {
+    auto begin = segments_.begin(), end = std::next(segments_.begin(), count);
+    QJsonObject obj;
+    obj["merge_all_ms"] = stats(measure(iterations, [&]() {
+      mergeSegments(end, end);
+      mergeSegments(begin, end);
+    }));
+    if (count > 1) {
+      obj["evict_one_ms"] = stats(measure(iterations, [&]() {
+        mergeSegments(std::next(begin), end);
+        mergeSegments(begin, end);
+      }));
+    }
+    obj["events"] = (qint64)events_.size();
+    return obj;
+  }
+
+  // publishes all merged events as fast as possible, returns events/s of each iteration
+  QJsonObject benchPublish(int iterations) {
+    addFlag(REPLAY_FLAG_FLOW_CONTROL);
+    route_start_ts_ = events_.upperBound(Event(cereal::Event::Which::INIT_DATA, 0, {}))->mono_time;
+    const size_t count = events_.size();
+    std::vector<double> rates;
+    for (auto ms : measure(iterations, [&]() {
+      auto cursor = events_.upperBound(Event(cereal::Event::Which::INIT_DATA, 0, {}));
+      cur_mono_time_ = route_start_ts_;
+      paused_ = false;
+      publishEvents(cursor);
+    })) {
+      rates.push_back(count / (ms / 1000.0));
+    }
+    QJsonObject obj;
+    obj["events_per_sec"] = stats(rates);
+    return obj;
+  }
+};
+
+QJsonObject benchLoad(Route &route, int count, int iterations) {
+  std::vector<double> read, decompress, parse, load;
+  for (auto it = route.segments().begin(); it != route.segments().end() && count-- > 0; ++it) {
+    const std::string file = (it->second.rlog.isEmpty() ? it->second.qlog : it->second.rlog).toStdString();
+    for (int i = 0; i < iterations; ++i) {
+      double t0 = millis_since_boot();
+      std::string content = util::read_file(file);
+      double t1 = millis_since_boot();
+      std::string data = util::ends_with(file, ".bz2") ? decompressBZ2(content)
+                         : util::ends_with(file, ".zst") ? decompressZST(content) : content;
+      double t2 = millis_since_boot();
+      LogReader log;
+      log.load(data.data(), data.size());
+      double t3 = millis_since_boot();
+      LogReader streamed_log;
+      streamed_log.load(file);
+      double t4 = millis_since_boot();
+
+      read.push_back(t1 - t0);
+      decompress.push_back(t2 - t1);
+      parse.push_back(t3 - t2);
+      load.push_back(t4 - t3);
+    }
+  }
+  QJsonObject obj;
+  obj["read_ms"] = stats(read);
+  obj["decompress_ms"] = stats(decompress);
+  obj["parse_ms"] = stats(parse);
+  obj["load_ms"] = stats(load);
+  return obj;
+}
+
+QJsonObject benchDecode(Route &route, bool no_hw_decoder) {
+  QJsonObject obj;
+  const auto &files = route.segments().begin()->second;
+  const std::pair<const char *, QString> cameras[] = {
+    {"road", files.road_cam}, {"driver", files.driver_cam}, {"wide_road", files.wide_road_cam}, {"qcamera", files.qcamera},
+  };
+  for (int i = 0; i < std::size(cameras); ++i) {
+    const auto &[name, file] = cameras[i];
+    if (file.isEmpty()) continue;
+
+    FrameReader fr;
+    CameraType type = i < MAX_CAMERAS ? ALL_CAMERAS[i] : RoadCam;
+    if (!fr.loadFromFile(type, file.toStdString(), no_hw_decoder)) continue;
+
+    auto [nv12_width, nv12_height, nv12_buffer_size] = get_nv12_info(fr.width, fr.height);
+    VisionBuf buf;
+    buf.allocate(nv12_buffer_size);
+    buf.init_yuv(fr.width, fr.height, nv12_width, nv12_width * nv12_height);
+    double start = millis_since_boot();
+    int decoded = 0;
+    for (int n = 0; n < fr.getFrameCount(); ++n) {
+      decoded += fr.get(n, &buf);
+    }
+    double elapsed = millis_since_boot() - start;
+    buf.free();
+
+    QJsonObject cam;
+    cam["frames"] = decoded;
+    cam["fps"] = decoded / (elapsed / 1000.0);
+    obj[name] = cam;
+  }
+  return obj;
+}
+
+// seek latency from seekTo to seekedTo, to random positions of the first count segments
+QJsonObject benchSeek(const QString &route, const QString &data_dir, int count, int iterations) {
+  Replay replay(route, {}, {}, nullptr, REPLAY_FLAG_NO_VIPC | REPLAY_FLAG_NO_FILE_CACHE, data_dir);
+  if (!replay.load()) return {};
+
+  // seekedTo is emitted from seekTo if the segment is already loaded
+  QEventLoop loop;
+  bool seeked = false;
+  QObject::connect(&replay, &Replay::seekedTo, [&]() {
+    seeked = true;
+    loop.quit();
+  });
+  auto seek = [&](std::function<void()> f) {
+    seeked = false;
+    f();
+    if (!seeked) loop.exec();
+  };
+
+  seek([&]() { replay.start(); });
+  std::vector<double> samples = measure(iterations, [&]() {
+    seek([&]() { replay.seekTo(util::random_int(0, count * 60 - 1), false); });
+  });
+  QJsonObject obj;
+  obj["seek_ms"] = stats(samples);
+  return obj;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Benchmark replay on a local route, results are printed as JSON.");
+  parser.addHelpOption();
+  parser.addPositionalArgument("route", "the route to benchmark");
+  parser.addOption({"data_dir", "local directory with routes", "data_dir"});
+  parser.addOption({{"n", "segments"}, "use the first <n> segments. default is 2", "n", "2"});
+  parser.addOption({{"i", "iterations"}, "repeat each benchmark <n> times. default is 3", "n", "3"});
+  parser.addOption({"no-hw-decoder", "disable HW video decoding"});
+  parser.process(app);
+
+  const QStringList args = parser.positionalArguments();
+  if (args.empty() || parser.value("data_dir").isEmpty()) {
+    parser.showHelp();
+  }
+  const QString route_name = args.first();
+  const QString data_dir = parser.value("data_dir");
+  const int iterations = std::max(1, parser.value("iterations").toInt());
+  const bool no_hw_decoder = parser.isSet("no-hw-decoder");
+
+  Route route(route_name, data_dir);
+  if (!route.load()) {
+    fprintf(stderr, "failed to load route %s from %s\n", qPrintable(route_name), qPrintable(data_dir));
+    return 1;
+  }
+  const int segments = std::clamp(parser.value("segments").toInt(), 1, (int)route.segments().size());
+
+  QJsonObject result;
+  result["route"] = route_name;
+  result["segments"] = segments;
+  result["iterations"] = iterations;
+  result["segment_load"] = benchLoad(route, segments, iterations);
+  result["decode"] = benchDecode(route, no_hw_decoder);
+  result["seek"] = benchSeek(route_name, data_dir, segments, iterations);
+  {
+    uint32_t flags = REPLAY_FLAG_NO_VIPC | REPLAY_FLAG_NO_FILE_CACHE | (no_hw_decoder ? REPLAY_FLAG_NO_HW_DECODER : 0);
+    BenchReplay replay(route_name, {}, {}, nullptr, flags, data_dir);
+    if (replay.load() && replay.loadSegments(segments)) {
+      result["merge"] = replay.benchMerge(segments, iterations);
+      result["publish"] = replay.benchPublish(iterations);
+    }
+  }
+
+  printf("%s\n", QJsonDocument(result).toJson().constData());
+  return 0;
+}
@@ -1,5 +1,17 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
 #include <chrono>
+#include <mutex>
+#include <new>
+#include <set>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include <QEventLoop>
 
@@ -33,6 +45,12 @@ TEST_CASE("httpMultiPartDownload") {
     REQUIRE(download_to_file(TEST_RLOG_URL, filename, chunk_size));
     content = util::read_file(filename);
   }
+  SECTION("resume download to file") {
+    REQUIRE(download_to_file(TEST_RLOG_URL, filename, chunk_size));
+    REQUIRE(truncate(filename, 1024 * 1024) == 0);
+    REQUIRE(download_to_file(TEST_RLOG_URL, filename, chunk_size));
+    content = util::read_file(filename);
+  }
   SECTION("download to buffer") {
     for (int i = 0; i < 3 && content.empty(); ++i) {
       content = httpGet(TEST_RLOG_URL, chunk_size);
@@ -44,6 +62,162 @@ TEST_CASE("httpMultiPartDownload") {
   REQUIRE(sha256(content) == TEST_RLOG_CHECKSUM);
 }
 
+// Serves content on localhost with HEAD and range requests. While drop_every is set, every drop_every-th range
+// request is answered with only half of the range before the connection is closed. The retry of a dropped range
+// is not dropped again. The content has an ETag, a range request whose If-Range doesn't match it gets all of it.
+class TestHttpServer {
+public:
+  TestHttpServer(const std::string &content) : content_(content) {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {.sin_family = AF_INET, .sin_port = 0, .sin_addr = {.s_addr = htonl(INADDR_LOOPBACK)}};
+    socklen_t len = sizeof(addr);
+    bind(listen_fd_, (sockaddr *)&addr, len);
+    listen(listen_fd_, 16);
+    getsockname(listen_fd_, (sockaddr *)&addr, &len);
+    port_ = ntohs(addr.sin_port);
+    thread_ = std::thread(&TestHttpServer::run, this);
+  }
+  ~TestHttpServer() {
+    exit_ = true;
+    thread_.join();
+    for (auto &t : connections_) t.join();
+    close(listen_fd_);
+  }
+  std::string url() const { return "http://127.0.0.1:" + std::to_string(port_) + "/file"; }
+  void setContent(const std::string &content, const std::string &etag) {
+    std::lock_guard lk(lock_);
+    content_ = content;
+    etag_ = etag;
+  }
+
+  std::atomic<int> drop_every = 0;
+  std::atomic<int> range_requests = 0;
+  std::atomic<int> dropped = 0;
+  // the number of HEAD requests still answered with the previous ETag, as if the content changed right after
+  std::atomic<int> stale_heads = 0;
+
+private:
+  void run() {
+    while (!exit_) {
+      pollfd pfd = {.fd = listen_fd_, .events = POLLIN};
+      if (poll(&pfd, 1, 100) > 0) {
+        int fd = accept(listen_fd_, nullptr, nullptr);
+        if (fd >= 0) connections_.emplace_back(&TestHttpServer::serve, this, fd);
+      }
+    }
+  }
+
+  void serve(int fd) {
+    std::string request;
+    char buf[4096];
+    while (request.find("\r\n\r\n") == std::string::npos) {
+      ssize_t n = recv(fd, buf, sizeof(buf), 0);
+      if (n <= 0) break;
+      request.append(buf, n);
+    }
+
+    std::unique_lock lk(lock_);
+    const std::string content = content_, etag = etag_;
+    lk.unlock();
+
+    std::string response;
+    size_t begin = 0, end = 0;
+    const size_t range = request.find("\r\nRange: bytes=");
+    const size_t if_range = request.find("\r\nIf-Range: ");
+    if (request.rfind("HEAD", 0) == 0) {
+      const std::string head_etag = stale_heads-- > 0 ? prev_etag_ : etag;
+      response = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(content.size()) + "\r\nETag: " + head_etag +
+                 "\r\nConnection: close\r\n\r\n";
+    } else if (if_range != std::string::npos && request.compare(if_range + 12, etag.size() + 2, etag + "\r\n") != 0) {
+      response = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(content.size()) + "\r\nConnection: close\r\n\r\n" + content;
+    } else if (range != std::string::npos && sscanf(request.c_str() + range, "\r\nRange: bytes=%zu-%zu", &begin, &end) == 2 &&
+               begin <= end && end < content.size()) {
+      std::string body = content.substr(begin, end - begin + 1);
+      response = util::string_format("HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %zu-%zu/%zu\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                                     begin, end, content_.size(), body.size());
+      int n = ++range_requests;
+      lk.lock();
+      if (drop_every > 0 && n % drop_every == 0 && dropped_ranges_.insert(end).second) {
+        ++dropped;
+        body.resize(body.size() / 2);
+      }
+      lk.unlock();
+      response += body;
+    } else {
+      response = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    }
+    for (size_t sent = 0; sent < response.size();) {
+      ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) break;
+      sent += n;
+    }
+    close(fd);
+  }
+
+  std::string content_;
+  std::string etag_ = "\"1\"";
+  const std::string prev_etag_ = "\"1\"";
+  int listen_fd_ = -1;
+  int port_ = 0;
+  std::atomic<bool> exit_ = false;
+  std::thread thread_;
+  std::vector<std::thread> connections_;
+  std::mutex lock_;
+  std::set<size_t> dropped_ranges_;
+};
+
+TEST_CASE("httpDownload from a local server") {
+  const std::string content = util::random_string(12 * 1024 * 1024 + 321);
+  const size_t chunk_size = 1024 * 1024;
+  TestHttpServer server(content);
+
+  SECTION("failed ranges are retried") {
+    server.drop_every = 3;
+    REQUIRE(httpGet(server.url(), chunk_size) == content);
+    REQUIRE(server.dropped > 0);
+  }
+  SECTION("an interrupted download is resumed") {
+    char filename[] = "/tmp/XXXXXX";
+    close(mkstemp(filename));
+    server.drop_every = 4;
+    REQUIRE(!httpDownload(server.url(), filename, chunk_size, nullptr, 0));
+    const std::string partial = util::read_file(filename);
+    REQUIRE(partial.size() < content.size());
+    REQUIRE(partial == content.substr(0, partial.size()));
+
+    server.drop_every = 0;
+    const int range_requests = server.range_requests;
+    REQUIRE(httpDownload(server.url(), filename, chunk_size, nullptr, 0));
+    REQUIRE(util::read_file(filename) == content);
+    // only the missing part is downloaded again
+    REQUIRE(server.range_requests - range_requests <= (content.size() - partial.size()) / chunk_size + 1);
+    REQUIRE(!util::file_exists(std::string(filename) + ".validator"));
+    unlink(filename);
+  }
+  SECTION("a partial download of a changed file is not continued") {
+    char filename[] = "/tmp/XXXXXX";
+    close(mkstemp(filename));
+    server.drop_every = 4;
+    REQUIRE(!httpDownload(server.url(), filename, chunk_size, nullptr, 0));
+    REQUIRE(util::read_file(std::string(filename) + ".validator") == "\"1\"");
+
+    const std::string new_content = util::random_string(content.size());
+    server.drop_every = 0;
+    server.setContent(new_content, "\"2\"");
+    SECTION("changed before the download continues") {
+      REQUIRE(httpDownload(server.url(), filename, chunk_size, nullptr, 0));
+    }
+    SECTION("changed while the download continues") {
+      // the HEAD request still sees the old version, If-Range catches the change
+      server.stale_heads = 1;
+      REQUIRE(httpDownload(server.url(), filename, chunk_size, nullptr, 0));
+    }
+    REQUIRE(util::read_file(filename) == new_content);
+    unlink(filename);
+    unlink((std::string(filename) + ".validator").c_str());
+  }
+}
+
 TEST_CASE("FileReader") {
   auto enable_local_cache = GENERATE(true, false);
   std::string cache_file = cacheFilePath(TEST_RLOG_URL);
@@ -59,6 +233,45 @@ TEST_CASE("FileReader") {
   }
 }
 
+TEST_CASE("DownloadCache") {
+  char dir[] = "/tmp/download_cacheXXXXXX";
+  REQUIRE(mkdtemp(dir) != nullptr);
+  DownloadCache cache(dir);
+
+  // files in the order they were used
+  const std::string files[] = {cache.dir() + "a", cache.dir() + "b", cache.dir() + "c"};
+  for (int i = 0; i < std::size(files); ++i) {
+    util::write_file(files[i].c_str(), std::string(1000, 'x').data(), 1000, O_WRONLY | O_CREAT);
+    struct timeval times[2] = {{1000 + i, 0}, {1000 + i, 0}};
+    utimes(files[i].c_str(), times);
+  }
+  REQUIRE(cache.size() == 3000);
+
+  SECTION("no limit") {
+    cache.trim();
+    REQUIRE(cache.size() == 3000);
+  }
+  SECTION("least recently used files are removed first") {
+    cache.touch(files[0]);
+    cache.setMaxSize(2000);
+    cache.trim();
+    REQUIRE(util::file_exists(files[0]));
+    REQUIRE(!util::file_exists(files[1]));
+    REQUIRE(util::file_exists(files[2]));
+  }
+  SECTION("commit") {
+    const std::string tmp_file = cache.dir() + "d.part";
+    util::write_file(tmp_file.c_str(), std::string(1500, 'x').data(), 1500, O_WRONLY | O_CREAT);
+    cache.setMaxSize(2500);
+    REQUIRE(cache.commit(tmp_file, cache.dir() + "d"));
+    REQUIRE(!util::file_exists(tmp_file));
+    REQUIRE(util::file_exists(cache.dir() + "d"));
+    REQUIRE(util::file_exists(files[2]));
+    REQUIRE(cache.size() == 2500);
+  }
+  system(("rm -rf " + std::string(dir)).c_str());
+}
+
 TEST_CASE("LogReader") {
   SECTION("corrupt log") {
     FileReader reader(true);
@@ -69,11 +282,385 @@ TEST_CASE("LogReader") {
     REQUIRE(log.load(corrupt_content.data(), corrupt_content.size()));
     REQUIRE(log.events.size() > 0);
   }
+  SECTION("memory mapped local file") {
+    FileReader reader(true);
+    std::string content = decompressBZ2(reader.read(TEST_RLOG_URL));
+    char filename[] = "/tmp/XXXXXX";
+    close(mkstemp(filename));
+    REQUIRE(util::write_file(filename, content.data(), content.size(), O_WRONLY | O_TRUNC) == 0);
+
+    LogReader mapped_log, log;
+    REQUIRE(mapped_log.load(filename));
+    REQUIRE(log.load(content.data(), content.size()));
+    REQUIRE(mapped_log.events.size() == log.events.size());
+    REQUIRE(std::equal(log.events.begin(), log.events.end(), mapped_log.events.begin(), [](const Event &l, const Event &r) {
+      return l.mono_time == r.mono_time && l.which == r.which && l.data.size() == r.data.size();
+    }));
+    unlink(filename);
+  }
+  SECTION("log index") {
+    const std::string index_file = logIndexFilePath(TEST_RLOG_URL);
+    system(("rm " + index_file + " -f").c_str());
+
+    LogReader log;
+    REQUIRE(log.load(TEST_RLOG_URL, nullptr, true));
+    REQUIRE(util::file_exists(index_file));
+
+    LogReader indexed_log;
+    REQUIRE(indexed_log.load(TEST_RLOG_URL, nullptr, true));
+    REQUIRE(indexed_log.events.size() == log.events.size());
+    REQUIRE(std::equal(log.events.begin(), log.events.end(), indexed_log.events.begin(), [](const Event &l, const Event &r) {
+      return l.mono_time == r.mono_time && l.which == r.which && l.eidx_segnum == r.eidx_segnum &&
+             l.data.asBytes() == r.data.asBytes();
+    }));
+
+    std::vector<bool> filters(capnp::Schema::from<cereal::Event>().asStruct().getUnionFields().size(), false);
+    filters[cereal::Event::CAN] = true;
+    LogReader filtered_log(filters);
+    REQUIRE(filtered_log.load(TEST_RLOG_URL, nullptr, true));
+    REQUIRE(filtered_log.events.size() == std::count_if(log.events.begin(), log.events.end(),
+                                                       [](const Event &e) { return e.which == cereal::Event::CAN; }));
+  }
+  SECTION("zstd cache") {
+    const std::string cache_file = cacheFilePath(TEST_RLOG_URL);
+    system(("rm " + cache_file + " -f").c_str());
+    std::string content = decompressBZ2(FileReader(false).read(TEST_RLOG_URL));
+    LogReader log;
+    REQUIRE(log.load(content.data(), content.size()));
+
+    LogReader transcoded_log;
+    transcoded_log.setCacheAsZstd(true);
+    REQUIRE(transcoded_log.load(TEST_RLOG_URL, nullptr, true));
+    std::string cached = util::read_file(cache_file);
+    std::vector<SeekableZstdFrame> frames;
+    REQUIRE(readSeekableZstdFrames((const std::byte *)cached.data(), cached.size(), frames));
+    REQUIRE(decompressZST(cached) == content);
+
+    // loaded from the seekable zstd, with and without the index
+    for (bool with_index : {true, false}) {
+      if (!with_index) system(("rm " + logIndexFilePath(TEST_RLOG_URL) + " -f").c_str());
+      LogReader seekable_log;
+      REQUIRE(seekable_log.load(TEST_RLOG_URL, nullptr, true));
+      REQUIRE(seekable_log.events.size() == log.events.size());
+      REQUIRE(std::equal(log.events.begin(), log.events.end(), seekable_log.events.begin(), [](const Event &l, const Event &r) {
+        return l.mono_time == r.mono_time && l.which == r.which && l.data.asBytes() == r.data.asBytes();
+      }));
+    }
+    system(("rm " + cache_file + " -f").c_str());
+  }
+  SECTION("streaming decompression") {
+    FileReader reader(true);
+    std::string content = decompressBZ2(reader.read(TEST_RLOG_URL));
+
+    LogReader streamed_log, log;
+    REQUIRE(streamed_log.load(TEST_RLOG_URL, nullptr, true));
+    REQUIRE(log.load(content.data(), content.size()));
+    REQUIRE(streamed_log.events.size() == log.events.size());
+    REQUIRE(std::equal(log.events.begin(), log.events.end(), streamed_log.events.begin(), [](const Event &l, const Event &r) {
+      return l.mono_time == r.mono_time && l.which == r.which &&
+             l.data.asBytes() == r.data.asBytes();
+    }));
+  }
+}
+
+TEST_CASE("SeekableZstd") {
+  std::string content;
+  for (int i = 0; content.size() < 10 * 1024 * 1024 + 123; ++i) {
+    content += std::to_string(i) + util::random_string(i % 64);
+  }
+  // frames are compressed in parallel with more than one thread
+  const int threads = GENERATE(1, 4);
+  SeekableZstdWriter writer(1024 * 1024, 3, threads);
+  REQUIRE(writer.write(content.data(), content.size() / 2));
+  REQUIRE(writer.write(content.data() + content.size() / 2, content.size() - content.size() / 2));
+  const std::string compressed = writer.finish();
+  const std::byte *in = (const std::byte *)compressed.data();
+
+  std::vector<SeekableZstdFrame> frames;
+  REQUIRE(readSeekableZstdFrames(in, compressed.size(), frames));
+  REQUIRE(frames.size() == 11);
+  REQUIRE(frames.back().offset + frames.back().size == content.size());
+
+  SECTION("plain zstd decoders read the whole content") {
+    REQUIRE(decompressZST(compressed) == content);
+  }
+  SECTION("decompress all frames") {
+    std::string out(content.size(), '\0');
+    REQUIRE(decompressZSTSeekable(in, compressed.size(), frames, 0, out.size(), out.data()));
+    REQUIRE(out == content);
+  }
+  SECTION("decompress a range") {
+    const size_t offset = 1024 * 1024 - 100, size = 2 * 1024 * 1024 + 200;
+    std::string out(size, '\0');
+    REQUIRE(decompressZSTSeekable(in, compressed.size(), frames, offset, size, out.data()));
+    REQUIRE(out == content.substr(offset, size));
+  }
+  SECTION("not seekable") {
+    REQUIRE(!readSeekableZstdFrames((const std::byte *)content.data(), content.size(), frames));
+  }
+}
+
+TEST_CASE("LatencyHistogram") {
+  LatencyHistogram h;
+  REQUIRE(h.percentile(50) == 0);
+  for (int i = 0; i < 100; ++i) {
+    h.add(i + 0.5);
+  }
+  REQUIRE(h.count() == 100);
+  REQUIRE(h.mean() == 50);
+  REQUIRE(h.percentile(50) == 50);
+  REQUIRE(h.percentile(99) == 99);
+  REQUIRE(h.percentile(100) == 99.5);
+
+  h.add(1000);
+  REQUIRE(h.percentile(100) == 1000);
+}
+
+TEST_CASE("MergedEvents") {
+  EventTable seg0, seg1;
+  for (uint64_t t = 0; t < 100; ++t) {
+    seg0.emplace_back(cereal::Event::Which::CAN, t * 2, kj::ArrayPtr<const capnp::word>{});
+    seg1.emplace_back(cereal::Event::Which::CAN, 150 + t, kj::ArrayPtr<const capnp::word>{});
+  }
+
+  MergedEvents events;
+  events.insert(0, &seg0);
+  events.insert(1, &seg1);
+  REQUIRE(events.size() == seg0.size() + seg1.size());
+  REQUIRE(events.back().mono_time == seg1.back().mono_time);
+
+  std::vector<Event> merged;
+  for (auto cursor = events.upperBound(Event(cereal::Event::Which::CAN, 100, {})); !cursor.end(); cursor.next()) {
+    merged.push_back(*cursor);
+  }
+  REQUIRE(merged.size() == 49 + 100);
+  REQUIRE(merged.front().mono_time == 102);
+  REQUIRE(std::is_sorted(merged.begin(), merged.end()));
+
+  events.erase(1);
+  REQUIRE(!events.contains(1));
+  REQUIRE(events.size() == seg0.size());
+  REQUIRE(events.upperBound(seg0.back()).end());
+}
+
+TEST_CASE("MergedEvents ties and filtered services") {
+  // eidx_segnum tags each event with its segment
+  EventTable seg[2];
+  for (int n : {1, 0}) {
+    for (uint64_t t = 0; t < 10; ++t) {
+      seg[n].emplace_back(cereal::Event::Which::CAN, t, kj::ArrayPtr<const capnp::word>{}, n);
+      seg[n].emplace_back(cereal::Event::Which::SENDCAN, t, kj::ArrayPtr<const capnp::word>{}, n);
+    }
+  }
+  MergedEvents events;
+  events.insert(1, &seg[1]);
+  events.insert(0, &seg[0]);
+
+  auto merge = [&]() {
+    std::vector<Event> merged;
+    for (auto cursor = events.upperBound(Event(cereal::Event::Which::INIT_DATA, 0, {})); !cursor.end(); cursor.next()) {
+      merged.push_back(*cursor);
+    }
+    return merged;
+  };
+
+  // equal events keep the segment order
+  auto merged = merge();
+  REQUIRE(merged.size() == 40);
+  for (size_t i = 0; i < merged.size(); ++i) {
+    REQUIRE(merged[i].mono_time == i / 4);
+    REQUIRE(merged[i].which == (i % 4 < 2 ? cereal::Event::Which::CAN : cereal::Event::Which::SENDCAN));
+    REQUIRE(merged[i].eidx_segnum == i % 2);
+  }
+
+  std::vector<bool> services(cereal::Event::Which::SENDCAN + 1);
+  services[cereal::Event::Which::SENDCAN] = true;
+  events.setServices(services);
+  merged = merge();
+  REQUIRE(merged.size() == 20);
+  REQUIRE(std::all_of(merged.begin(), merged.end(), [](const Event &e) { return e.which == cereal::Event::Which::SENDCAN; }));
+}
+
+TEST_CASE("EventTable") {
+  std::vector<Event> events;
+  for (uint64_t t = 0; t < 100; ++t) {
+    events.emplace_back(t % 2 ? cereal::Event::Which::CAN : cereal::Event::Which::SENDCAN, t / 2, kj::ArrayPtr<const capnp::word>{}, t);
+  }
+  std::sort(events.begin(), events.end());
+
+  EventTable table;
+  for (const Event &e : events) {
+    table.push_back(e);
+  }
+  REQUIRE(table.size() == events.size());
+  REQUIRE(std::is_sorted(table.begin(), table.end()));
+  REQUIRE(std::equal(table.begin(), table.end(), events.begin(), [](const Event &l, const Event &r) {
+    return l.mono_time == r.mono_time && l.which == r.which && l.eidx_segnum == r.eidx_segnum;
+  }));
+  for (const Event &e : events) {
+    REQUIRE(table.upperBound(e) - table.begin() == std::upper_bound(events.begin(), events.end(), e) - events.begin());
+  }
+}
+
+TEST_CASE("EventTable::sort") {
+  // out of order, with ties that keep the order they were added in
+  std::vector<Event> events;
+  for (uint64_t i = 0; i < 300; ++i) {
+    events.emplace_back(i % 3 ? cereal::Event::Which::CAN : cereal::Event::Which::SENDCAN, (i * 37) % 50, kj::ArrayPtr<const capnp::word>{}, i);
+  }
+  EventTable table;
+  for (const Event &e : events) {
+    table.push_back(e);
+  }
+  table.sort();
+  std::stable_sort(events.begin(), events.end());
+
+  REQUIRE(table.size() == events.size());
+  REQUIRE(std::equal(table.begin(), table.end(), events.begin(), [](const Event &l, const Event &r) {
+    return l.mono_time == r.mono_time && l.which == r.which && l.eidx_segnum == r.eidx_segnum;
+  }));
+}
+
+TEST_CASE("locateEncodeIdxPackets") {
+  // a stream header followed by three packets, each starting with a start code
+  const std::string header("\0\0\0\x01\x40\x01\x0c\x01\xff\xff", 10);
+  const std::string packet_data[] = {std::string("\0\0\x01\x26\x01\xaf\x06\xb8", 8),
+                                     std::string("\0\0\x01\x02\x01\xd0", 6),
+                                     std::string("\0\0\x01\x02\x01\xd1\x80", 7)};
+  const std::string video = header + packet_data[0] + packet_data[1] + packet_data[2];
+  std::vector<EncodeIdxPacket> packets = {{0, ENCODE_IDX_FLAG_KEYFRAME, 8}, {1, 0, 6}, {2, 0, 7}};
+
+  std::vector<int64_t> positions;
+  REQUIRE(locateEncodeIdxPackets(video.data(), video.size(), packets, positions) == 10);
+  REQUIRE(positions == std::vector<int64_t>{10, 18, 24});
+
+  SECTION("the first packet is not a key frame") {
+    packets[0].flags = 0;
+    REQUIRE(locateEncodeIdxPackets(video.data(), video.size(), packets, positions) == -1);
+  }
+  SECTION("a packet doesn't start with a start code") {
+    packets[1].len = 7;
+    packets[2].len = 6;
+    REQUIRE(locateEncodeIdxPackets(video.data(), video.size(), packets, positions) == -1);
+  }
+  SECTION("the packets are larger than the video") {
+    packets[2].len = 20;
+    REQUIRE(locateEncodeIdxPackets(video.data(), video.size(), packets, positions) == -1);
+  }
+}
+
+TEST_CASE("FrameReader packet index") {
+  Route route(DEMO_ROUTE);
+  REQUIRE(route.load());
+  const std::string road_cam = route.at(0).road_cam.toStdString();
+  ::remove((cacheFilePath(road_cam) + ".pidx").c_str());
+
+  // reads all packets, the index is cached
+  FrameReader scanned;
+  REQUIRE(scanned.load(RoadCam, road_cam, true, nullptr, true));
+  REQUIRE(scanned.getFrameCount() == 1200);
+
+  auto same_frames = [&](FrameReader &fr) {
+    REQUIRE(fr.getFrameCount() == scanned.getFrameCount());
+    for (int i = 0; i < fr.getFrameCount(); ++i) {
+      REQUIRE((fr.packets_info[i].flags & AV_PKT_FLAG_KEY) == (scanned.packets_info[i].flags & AV_PKT_FLAG_KEY));
+    }
+    auto [nv12_width, nv12_height, nv12_buffer_size] = get_nv12_info(fr.width, fr.height);
+    VisionBuf buf[2];
+    for (auto &b : buf) {
+      b.allocate(nv12_buffer_size);
+      b.init_yuv(fr.width, fr.height, nv12_width, nv12_width * nv12_height);
+    }
+    for (int i : {0, 1, 250, 1199}) {
+      REQUIRE(fr.get(i, &buf[0]));
+      REQUIRE(scanned.get(i, &buf[1]));
+      REQUIRE(memcmp(buf[0].addr, buf[1].addr, nv12_buffer_size) == 0);
+    }
+    for (auto &b : buf) b.free();
+  };
+
+  SECTION("from encodeIdx events") {
+    LogReader log;
+    REQUIRE(log.load(route.at(0).rlog.toStdString(), nullptr, true));
+    std::vector<EncodeIdxPacket> packets;
+    for (const Event &e : log.events) {
+      if (e.which != cereal::Event::ROAD_ENCODE_IDX || e.eidx_segnum != -1) continue;
+      capnp::FlatArrayMessageReader reader(e.data);
+      auto idx = reader.getRoot<cereal::Event>().getRoadEncodeIdx();
+      if (idx.getSegmentNum() == 0) packets.push_back({idx.getSegmentIdEncode(), idx.getFlags(), idx.getLen()});
+    }
+    FrameReader fr;
+    REQUIRE(fr.open(RoadCam, road_cam, true));
+    REQUIRE(fr.buildPacketIndex(packets));
+    same_frames(fr);
+
+    // events that don't match the video fall back to reading all packets
+    auto fallback_to_scan = [&](const std::vector<EncodeIdxPacket> &mismatched_packets) {
+      FrameReader mismatched;
+      REQUIRE(mismatched.open(RoadCam, road_cam, true));
+      REQUIRE(mismatched.buildPacketIndex(mismatched_packets));
+      same_frames(mismatched);
+    };
+    auto missing_last = packets;
+    missing_last.pop_back();
+    fallback_to_scan(missing_last);
+    // without key frame flags, only the total length would match
+    auto no_key_frames = packets;
+    for (auto &p : no_key_frames) p.flags &= ~ENCODE_IDX_FLAG_KEYFRAME;
+    fallback_to_scan(no_key_frames);
+    // the same total length, with the third packet moved into the data of its NAL. One byte in, a 4 byte
+    // start code would still be found.
+    auto shifted = packets;
+    shifted[1].len += 16;
+    shifted[2].len -= 16;
+    fallback_to_scan(shifted);
+  }
+  SECTION("cached index") {
+    REQUIRE(util::file_exists(cacheFilePath(road_cam) + ".pidx"));
+    FrameReader fr;
+    REQUIRE(fr.open(RoadCam, road_cam, true, nullptr, true));
+    REQUIRE(fr.buildPacketIndex());
+    same_frames(fr);
+  }
+}
+
+TEST_CASE("FrameReader at the address of a destroyed reader") {
+  Route route(DEMO_ROUTE);
+  REQUIRE(route.load());
+  REQUIRE(route.segments().size() >= 2);
+  const std::string video[] = {route.at(0).road_cam.toStdString(), route.at(1).road_cam.toStdString()};
+
+  FrameReader expected;
+  REQUIRE(expected.load(RoadCam, video[1], true));
+  auto [nv12_width, nv12_height, nv12_buffer_size] = get_nv12_info(expected.width, expected.height);
+  VisionBuf buf[2];
+  for (auto &b : buf) {
+    b.allocate(nv12_buffer_size);
+    b.init_yuv(expected.width, expected.height, nv12_width, nv12_width * nv12_height);
+  }
+
+  // leaves an idle decoder positioned at frame 6 of the first video
+  alignas(FrameReader) char storage[sizeof(FrameReader)];
+  FrameReader *fr = new (storage) FrameReader();
+  REQUIRE(fr->load(RoadCam, video[0], true));
+  for (int i = 0; i <= 5; ++i) REQUIRE(fr->get(i, &buf[0]));
+  fr->~FrameReader();
+
+  // a reader of another video at the same address must not continue from that state
+  fr = new (storage) FrameReader();
+  REQUIRE(fr->load(RoadCam, video[1], true));
+  REQUIRE(fr->get(6, &buf[0]));
+  REQUIRE(expected.get(6, &buf[1]));
+  REQUIRE(memcmp(buf[0].addr, buf[1].addr, nv12_buffer_size) == 0);
+  fr->~FrameReader();
+  for (auto &b : buf) b.free();
 }
 
 void read_segment(int n, const SegmentFile &segment_file, uint32_t flags) {
   QEventLoop loop;
-  Segment segment(n, segment_file, flags);
+  // declared before the segment, so it outlives the segment's loads
+  QThreadPool pool;
+  Segment segment(n, segment_file, flags, &pool);
   QObject::connect(&segment, &Segment::loadFinished, [&]() {
     REQUIRE(segment.isLoaded() == true);
     REQUIRE(segment.log != nullptr);
@@ -157,6 +744,43 @@ TEST_CASE("Remote route") {
   }
 }
 
+TEST_CASE("Progressive segment") {
+  Route route(DEMO_ROUTE);
+  REQUIRE(route.load());
+  QEventLoop loop;
+  // outlives the segment, like Replay's load pool, as the rlog is loaded on it after the qlog
+  QThreadPool pool;
+  Segment segment(0, route.at(0), REPLAY_FLAG_NO_VIPC | REPLAY_FLAG_PROGRESSIVE, &pool);
+  size_t qlog_events = 0;
+  QObject::connect(&segment, &Segment::loadFinished, [&](bool success) {
+    REQUIRE(success);
+    qlog_events = segment.log->events.size();
+  });
+  QObject::connect(&segment, &Segment::logUpgraded, &loop, &QEventLoop::quit);
+  loop.exec();
+
+  REQUIRE(qlog_events > 0);
+  auto qlog = segment.upgradeLog();
+  REQUIRE(qlog->events.size() == qlog_events);
+  REQUIRE(segment.log->events.size() > qlog_events);
+}
+
+TEST_CASE("SubMaster batched update") {
+  SubMaster sm({"carState", "can"});
+  MessageBuilder car_state, can;
+  car_state.initEvent().initCarState().setVEgo(10);
+  can.initEvent().initCan(1)[0].setAddress(0x100);
+  auto car_state_words = capnp::messageToFlatArray(car_state);
+  auto can_words = capnp::messageToFlatArray(can);
+
+  sm.update_msgs(nanos_since_boot(), {{cereal::Event::CAR_STATE, car_state_words}, {cereal::Event::CAN, can_words}});
+  REQUIRE(sm.updated("carState"));
+  REQUIRE(sm.updated("can"));
+  REQUIRE(sm["carState"].getCarState().getVEgo() == 10);
+  REQUIRE(sm["can"].getCan()[0].getAddress() == 0x100);
+  REQUIRE(sm.rcv_frame("carState") == sm.frame);
+}
+
 TEST_CASE("seek_to") {
   QEventLoop loop;
   int seek_to = util::random_int(0, 2 * 59);
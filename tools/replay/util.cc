@@ -3,17 +3,23 @@
 #include <bzlib.h>
 #include <curl/curl.h>
 #include <openssl/sha.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <cassert>
 #include <algorithm>
 #include <cmath>
 #include <cstdarg>
 #include <cstring>
+#include <deque>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <mutex>
 #include <numeric>
+#include <thread>
 #include <utility>
 #include <zstd.h>
 
@@ -60,38 +66,69 @@ struct CURLGlobalInitializer {
 
 static CURLGlobalInitializer curl_initializer;
 
-template <class T>
-struct MultiPartWriter {
-  T *buf;
-  size_t *total_written;
-  size_t offset;
+// A range of a download, fetched on its own connection. A failed range is retried from where it stopped.
+struct DownloadRange {
+  size_t begin;
+  size_t offset;  // the next byte to write
   size_t end;
+  int retries = 0;
+  double retry_ts = 0;
+};
+
+// writes data at an offset of the download, returns false on failure
+typedef std::function<bool(size_t offset, const char *data, size_t size)> DownloadSink;
+
+struct RangeWriter {
+  DownloadRange *range;
+  const DownloadSink *sink;
+  CURL *eh;
+  bool *changed;  // if If-Range is sent: set if the server sent the whole file instead, as it no longer matches
 
   size_t write(char *data, size_t size, size_t count) {
     size_t bytes = size * count;
-    if ((offset + bytes) > end) return 0;
-
-    if constexpr (std::is_same<T, std::string>::value) {
-      memcpy(buf->data() + offset, data, bytes);
-    } else if constexpr (std::is_same<T, std::ofstream>::value) {
-      buf->seekp(offset);
-      buf->write(data, bytes);
+    long status = 0;
+    curl_easy_getinfo(eh, CURLINFO_RESPONSE_CODE, &status);
+    if (status != 206) {
+      if (status == 200 && changed) *changed = true;
+      return 0;
     }
+    if ((range->offset + bytes) > range->end || !(*sink)(range->offset, data, bytes)) return 0;
 
-    offset += bytes;
-    *total_written += bytes;
+    range->offset += bytes;
     return bytes;
   }
 };
 
-template <class T>
 size_t write_cb(char *data, size_t size, size_t count, void *userp) {
-  auto w = (MultiPartWriter<T> *)userp;
-  return w->write(data, size, count);
+  return ((RangeWriter *)userp)->write(data, size, count);
 }
 
 size_t dumy_write_cb(char *data, size_t size, size_t count, void *userp) { return size * count; }
 
+struct Validators {
+  std::string etag;
+  std::string last_modified;
+};
+
+size_t validator_header_cb(char *data, size_t size, size_t count, void *userp) {
+  const size_t bytes = size * count;
+  std::string line(data, bytes);
+  const size_t colon = line.find(':');
+  if (colon != std::string::npos) {
+    std::string name = line.substr(0, colon);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    const size_t begin = line.find_first_not_of(" \t", colon + 1);
+    const size_t end = line.find_last_not_of(" \t\r\n");
+    std::string value = begin != std::string::npos && end >= begin ? line.substr(begin, end - begin + 1) : "";
+    if (name == "etag") {
+      ((Validators *)userp)->etag = value;
+    } else if (name == "last-modified") {
+      ((Validators *)userp)->last_modified = value;
+    }
+  }
+  return bytes;
+}
+
 struct DownloadStats {
   void installDownloadProgressHandler(DownloadProgressHandler handler) {
     std::lock_guard lk(lock);
@@ -130,6 +167,15 @@ struct DownloadStats {
 
 static DownloadStats download_stats;
 
+const size_t DECOMPRESS_CHUNK_SIZE = 1024 * 1024;
+
+const size_t MAX_DOWNLOAD_CONNECTIONS = 5;
+const int DOWNLOAD_RETRY_DELAY_MS = 500;
+
+const uint32_t ZSTD_SEEKABLE_SKIPPABLE_MAGIC = 0x184D2A5E;
+const uint32_t ZSTD_SEEKABLE_MAGIC = 0x8F92EAB1;
+const size_t ZSTD_SEEKABLE_FOOTER_SIZE = 9;
+
 } // namespace
 
 void installDownloadProgressHandler(DownloadProgressHandler handler) {
@@ -146,13 +192,15 @@ std::string formattedDataSize(size_t size) {
   }
 }
 
-size_t getRemoteFileSize(const std::string &url, std::atomic<bool> *abort) {
+size_t getRemoteFileSize(const std::string &url, std::atomic<bool> *abort, std::string *validator) {
   CURL *curl = curl_easy_init();
   if (!curl) return -1;
 
+  Validators validators;
   curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, dumy_write_cb);
-  curl_easy_setopt(curl, CURLOPT_HEADER, 1);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, validator_header_cb);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)&validators);
   curl_easy_setopt(curl, CURLOPT_NOBODY, 1);
 
   CURLM *cm = curl_multi_init();
@@ -168,6 +216,11 @@ size_t getRemoteFileSize(const std::string &url, std::atomic<bool> *abort) {
 
   double content_length = -1;
   curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &content_length);
+  if (validator) {
+    // If-Range only accepts a strong ETag
+    const bool strong_etag = !validators.etag.empty() && validators.etag.rfind("W/", 0) != 0;
+    *validator = strong_etag ? validators.etag : validators.last_modified;
+  }
   curl_multi_remove_handle(cm, curl);
   curl_easy_cleanup(curl);
   curl_multi_cleanup(cm);
@@ -179,103 +232,222 @@ std::string getUrlWithoutQuery(const std::string &url) {
   return (idx == std::string::npos ? url : url.substr(0, idx));
 }
 
-template <class T>
-bool httpDownload(const std::string &url, T &buf, size_t chunk_size, size_t content_length, std::atomic<bool> *abort) {
-  download_stats.add(url, content_length);
-
-  int parts = 1;
-  if (chunk_size > 0 && content_length > 10 * 1024 * 1024) {
-    parts = std::nearbyint(content_length / (float)chunk_size);
-    parts = std::clamp(parts, 1, 5);
+// Downloads the bytes [start, content_length) of url through sink, in ranges of chunk_size on up to
+// MAX_DOWNLOAD_CONNECTIONS parallel connections. A range that fails is retried on its own, continuing where it
+// stopped, after a backoff that doubles with every retry. *resume_offset is set to the offset up to which the
+// download is complete without gaps, which is where an interrupted download can continue.
+// The ranges are requested with If-Range: if_range, if it is set. *changed is set if the remote file no longer
+// matches it, which fails the download.
+static bool httpDownload(const std::string &url, const DownloadSink &sink, size_t chunk_size, size_t start, size_t content_length,
+                         int retries, std::atomic<bool> *abort, size_t *resume_offset = nullptr,
+                         const std::string &if_range = {}, bool *changed = nullptr) {
+  const size_t length = content_length - start;
+  const size_t range_size = chunk_size > 0 && length > 10 * 1024 * 1024 ? chunk_size : length;
+  std::vector<DownloadRange> ranges;
+  for (size_t offset = start; offset < content_length; offset += range_size) {
+    ranges.push_back({offset, offset, std::min(offset + range_size, content_length)});
+  }
+  std::vector<RangeWriter> writers(ranges.size());
+  std::deque<size_t> pending(ranges.size());
+  std::iota(pending.begin(), pending.end(), 0);
+  std::map<CURL *, size_t> active;
+  bool remote_changed = false;
+  struct curl_slist *headers = nullptr;
+  if (!if_range.empty()) {
+    headers = curl_slist_append(headers, ("If-Range: " + if_range).c_str());
   }
 
+  download_stats.add(url, content_length);
   CURLM *cm = curl_multi_init();
-  size_t written = 0;
-  std::map<CURL *, MultiPartWriter<T>> writers;
-  const int part_size = content_length / parts;
-  for (int i = 0; i < parts; ++i) {
+  auto start_range = [&](size_t i) {
     CURL *eh = curl_easy_init();
-    writers[eh] = {
-        .buf = &buf,
-        .total_written = &written,
-        .offset = (size_t)(i * part_size),
-        .end = i == parts - 1 ? content_length : (i + 1) * part_size,
-    };
-    curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, write_cb<T>);
-    curl_easy_setopt(eh, CURLOPT_WRITEDATA, (void *)(&writers[eh]));
+    writers[i] = {.range = &ranges[i], .sink = &sink, .eh = eh, .changed = headers ? &remote_changed : nullptr};
+    curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, write_cb);
+    curl_easy_setopt(eh, CURLOPT_WRITEDATA, (void *)(&writers[i]));
     curl_easy_setopt(eh, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(eh, CURLOPT_RANGE, util::string_format("%d-%d", writers[eh].offset, writers[eh].end - 1).c_str());
+    curl_easy_setopt(eh, CURLOPT_RANGE, util::string_format("%zu-%zu", ranges[i].offset, ranges[i].end - 1).c_str());
     curl_easy_setopt(eh, CURLOPT_HTTPGET, 1);
     curl_easy_setopt(eh, CURLOPT_NOSIGNAL, 1);
     curl_easy_setopt(eh, CURLOPT_FOLLOWLOCATION, 1);
-
-    curl_multi_add_handle(cm, eh);
-  }
-
-  int still_running = 1;
-  size_t prev_written = 0;
-  while (still_running > 0 && !(abort && *abort)) {
-    CURLMcode mc = curl_multi_perform(cm, &still_running);
-    if (mc != CURLM_OK) {
-      break;
+    if (headers) {
+      curl_easy_setopt(eh, CURLOPT_HTTPHEADER, headers);
     }
-    if (still_running > 0) {
-      curl_multi_wait(cm, nullptr, 0, 1000, nullptr);
+    curl_multi_add_handle(cm, eh);
+    active[eh] = i;
+  };
+  auto written = [&]() {
+    return std::accumulate(ranges.begin(), ranges.end(), start, [](size_t sum, auto &r) { return sum + r.offset - r.begin; });
+  };
+
+  bool failed = false;
+  size_t prev_written = start;
+  while (!failed && (!active.empty() || !pending.empty()) && !(abort && *abort)) {
+    const double now = millis_since_boot();
+    double next_retry_ts = 0;
+    for (auto it = pending.begin(); it != pending.end() && active.size() < MAX_DOWNLOAD_CONNECTIONS;) {
+      if (ranges[*it].retry_ts <= now) {
+        start_range(*it);
+        it = pending.erase(it);
+      } else {
+        next_retry_ts = next_retry_ts == 0 ? ranges[*it].retry_ts : std::min(next_retry_ts, ranges[*it].retry_ts);
+        ++it;
+      }
     }
 
-    if (((written - prev_written) / (double)content_length) >= 0.01) {
-      download_stats.update(url, written);
-      prev_written = written;
+    int still_running = 0;
+    if (curl_multi_perform(cm, &still_running) != CURLM_OK) {
+      failed = true;
+      break;
     }
-  }
 
-  CURLMsg *msg;
-  int msgs_left = -1;
-  int complete = 0;
-  while ((msg = curl_multi_info_read(cm, &msgs_left)) && !(abort && *abort)) {
-    if (msg->msg == CURLMSG_DONE) {
-      if (msg->data.result == CURLE_OK) {
-        long res_status = 0;
-        curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &res_status);
-        if (res_status == 206) {
-          complete++;
+    CURLMsg *msg;
+    int msgs_left = -1;
+    while ((msg = curl_multi_info_read(cm, &msgs_left))) {
+      if (msg->msg != CURLMSG_DONE) continue;
+
+      CURL *eh = msg->easy_handle;
+      DownloadRange &range = ranges[active[eh]];
+      long res_status = 0;
+      curl_easy_getinfo(eh, CURLINFO_RESPONSE_CODE, &res_status);
+      if (remote_changed) {
+        // retrying won't help, the ranges written so far are of another version of the file
+        rWarning("%s has changed since the download started", getUrlWithoutQuery(url).c_str());
+        failed = true;
+      } else if (msg->data.result != CURLE_OK || res_status != 206 || range.offset != range.end) {
+        if (range.retries++ < retries) {
+          const int delay = DOWNLOAD_RETRY_DELAY_MS << std::min(range.retries - 1, 5);
+          rWarning("download of bytes %zu-%zu failed (%s), retrying %d in %d ms", range.offset, range.end - 1,
+                   msg->data.result != CURLE_OK ? curl_easy_strerror(msg->data.result) : util::string_format("http error code: %ld", res_status).c_str(),
+                   range.retries, delay);
+          range.retry_ts = millis_since_boot() + delay;
+          pending.push_back(active[eh]);
         } else {
-          rWarning("Download failed: http error code: %d", res_status);
+          rWarning("Download failed: bytes %zu-%zu of %s", range.offset, range.end - 1, getUrlWithoutQuery(url).c_str());
+          failed = true;
         }
-      } else {
-        rWarning("Download failed: connection failure: %d",  msg->data.result);
       }
+      curl_multi_remove_handle(cm, eh);
+      curl_easy_cleanup(eh);
+      active.erase(eh);
+    }
+
+    if (size_t cur_written = written(); cur_written != prev_written) {
+      download_stats.update(url, cur_written);
+      prev_written = cur_written;
+    }
+    if (!active.empty()) {
+      curl_multi_wait(cm, nullptr, 0, 1000, nullptr);
+    } else if (next_retry_ts > 0) {
+      // all connections wait for their retry
+      util::sleep_for(std::clamp<int>(next_retry_ts - millis_since_boot(), 1, 100));
     }
   }
 
-  bool success = complete == parts;
-  download_stats.update(url, written, success);
+  const bool success = !failed && active.empty() && pending.empty() && !(abort && *abort);
+  download_stats.update(url, written(), success);
   download_stats.remove(url);
 
-  for (const auto &[e, w] : writers) {
-    curl_multi_remove_handle(cm, e);
-    curl_easy_cleanup(e);
+  for (const auto &[eh, _] : active) {
+    curl_multi_remove_handle(cm, eh);
+    curl_easy_cleanup(eh);
   }
   curl_multi_cleanup(cm);
+  curl_slist_free_all(headers);
+  if (changed) {
+    *changed = remote_changed;
+  }
 
+  if (resume_offset) {
+    *resume_offset = start;
+    for (const auto &r : ranges) {
+      if (r.begin != *resume_offset) break;
+      *resume_offset = r.offset;
+      if (r.offset != r.end) break;
+    }
+  }
   return success;
 }
 
-std::string httpGet(const std::string &url, size_t chunk_size, std::atomic<bool> *abort) {
-  size_t size = getRemoteFileSize(url, abort);
+static size_t remoteFileSize(const std::string &url, int retries, std::atomic<bool> *abort, std::string *validator = nullptr) {
+  for (int i = 0; i <= retries && !(abort && *abort); ++i) {
+    if (i > 0) {
+      util::sleep_for(DOWNLOAD_RETRY_DELAY_MS << std::min(i - 1, 5));
+    }
+    if (size_t size = getRemoteFileSize(url, abort, validator); size > 0) {
+      return size;
+    }
+  }
+  return 0;
+}
+
+std::string httpGet(const std::string &url, size_t chunk_size, std::atomic<bool> *abort, int retries) {
+  size_t size = remoteFileSize(url, retries, abort);
   if (size == 0) return {};
 
   std::string result(size, '\0');
-  return httpDownload(url, result, chunk_size, size, abort) ? result : "";
+  auto sink = [&result](size_t offset, const char *data, size_t n) {
+    memcpy(result.data() + offset, data, n);
+    return true;
+  };
+  return httpDownload(url, sink, chunk_size, 0, size, retries, abort) ? result : "";
 }
 
-bool httpDownload(const std::string &url, const std::string &file, size_t chunk_size, std::atomic<bool> *abort) {
-  size_t size = getRemoteFileSize(url, abort);
-  if (size == 0) return false;
+bool httpDownload(const std::string &url, const std::string &file, size_t chunk_size, std::atomic<bool> *abort, int retries) {
+  const std::string validator_file = file + ".validator";
+  // a file that changes during the download is downloaded again from the beginning, once
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    std::string validator;
+    size_t size = remoteFileSize(url, retries, abort, &validator);
+    if (size == 0) return false;
+
+    // The content of an existing file is the beginning of an interrupted download, only the rest is requested.
+    // It is kept only if it was downloaded from the same version of the remote file.
+    struct stat st = {};
+    size_t start = ::stat(file.c_str(), &st) == 0 ? st.st_size : 0;
+    if (start > size || validator.empty() || util::read_file(validator_file) != validator) start = 0;
+    if (start == size) {
+      ::unlink(validator_file.c_str());
+      return true;
+    }
+
+    int fd = HANDLE_EINTR(::open(file.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+    if (fd < 0) return false;
+    if (HANDLE_EINTR(::ftruncate(fd, start)) != 0) {
+      ::close(fd);
+      return false;
+    }
+    if (validator.empty()) {
+      ::unlink(validator_file.c_str());
+    } else {
+      util::write_file(validator_file.c_str(), validator.data(), validator.size(), O_WRONLY | O_CREAT | O_TRUNC);
+    }
 
-  std::ofstream of(file, std::ios::binary | std::ios::out);
-  of.seekp(size - 1).write("\0", 1);
-  return httpDownload(url, of, chunk_size, size, abort);
+    auto sink = [fd](size_t offset, const char *data, size_t n) {
+      while (n > 0) {
+        ssize_t ret = HANDLE_EINTR(::pwrite(fd, data, n, offset));
+        if (ret <= 0) return false;
+        data += ret;
+        offset += ret;
+        n -= ret;
+      }
+      return true;
+    };
+    size_t resume_offset = start;
+    bool changed = false;
+    bool success = httpDownload(url, sink, chunk_size, start, size, retries, abort, &resume_offset, validator, &changed);
+    if (!success) {
+      // drop the bytes after the first gap, so the next attempt can continue from the end of the file
+      if (HANDLE_EINTR(::ftruncate(fd, changed ? 0 : resume_offset)) != 0) {
+        ::unlink(file.c_str());
+      }
+    }
+    ::close(fd);
+    if (success) {
+      ::unlink(validator_file.c_str());
+    }
+    if (success || !changed || (abort && *abort)) return success;
+  }
+  return false;
 }
 
 std::string decompressBZ2(const std::string &in, std::atomic<bool> *abort) {
@@ -283,7 +455,21 @@ std::string decompressBZ2(const std::string &in, std::atomic<bool> *abort) {
 }
 
 std::string decompressBZ2(const std::byte *in, size_t in_size, std::atomic<bool> *abort) {
-  if (in_size == 0) return {};
+  std::string out;
+  out.reserve(in_size * 5);
+  auto append = [&out](const char *data, size_t size) {
+    out.append(data, size);
+    return true;
+  };
+  if (!decompressBZ2(in, in_size, append, abort)) {
+    return {};
+  }
+  out.shrink_to_fit();
+  return out;
+}
+
+bool decompressBZ2(const std::byte *in, size_t in_size, const DecompressCallback &callback, std::atomic<bool> *abort) {
+  if (in_size == 0) return false;
 
   bz_stream strm = {};
   int bzerror = BZ2_bzDecompressInit(&strm, 0, 0);
@@ -291,32 +477,30 @@ std::string decompressBZ2(const std::byte *in, size_t in_size, std::atomic<bool>
 
   strm.next_in = (char *)in;
   strm.avail_in = in_size;
-  std::string out(in_size * 5, '\0');
+  std::string out(DECOMPRESS_CHUNK_SIZE, '\0');
+  bool stopped = false;
   do {
-    strm.next_out = (char *)(&out[strm.total_out_lo32]);
-    strm.avail_out = out.size() - strm.total_out_lo32;
+    strm.next_out = out.data();
+    strm.avail_out = out.size();
 
-    const char *prev_write_pos = strm.next_out;
+    const unsigned int prev_avail_in = strm.avail_in;
     bzerror = BZ2_bzDecompress(&strm);
-    if (bzerror == BZ_OK && prev_write_pos == strm.next_out) {
+    const size_t produced = out.size() - strm.avail_out;
+    if (bzerror == BZ_OK && produced == 0 && prev_avail_in == strm.avail_in) {
       // content is corrupt
       bzerror = BZ_STREAM_END;
       rWarning("decompressBZ2 error: content is corrupt");
       break;
     }
 
-    if (bzerror == BZ_OK && strm.avail_in > 0 && strm.avail_out == 0) {
-      out.resize(out.size() * 2);
+    if ((bzerror == BZ_OK || bzerror == BZ_STREAM_END) && produced > 0 && !callback(out.data(), produced)) {
+      stopped = true;
+      break;
     }
   } while (bzerror == BZ_OK && !(abort && *abort));
 
   BZ2_bzDecompressEnd(&strm);
-  if (bzerror == BZ_STREAM_END && !(abort && *abort)) {
-    out.resize(strm.total_out_lo32);
-    out.shrink_to_fit();
-    return out;
-  }
-  return {};
+  return bzerror == BZ_STREAM_END && !stopped && !(abort && *abort);
 }
 
 std::string decompressZST(const std::string &in, std::atomic<bool> *abort) {
@@ -324,16 +508,31 @@ std::string decompressZST(const std::string &in, std::atomic<bool> *abort) {
 }
 
 std::string decompressZST(const std::byte *in, size_t in_size, std::atomic<bool> *abort) {
+  std::string decompressedData;
+  auto append = [&decompressedData](const char *data, size_t size) {
+    decompressedData.append(data, size);
+    return true;
+  };
+  if (!decompressZST(in, in_size, append, abort)) {
+    return {};
+  }
+  decompressedData.shrink_to_fit();
+  return decompressedData;
+}
+
+bool decompressZST(const std::byte *in, size_t in_size, const DecompressCallback &callback, std::atomic<bool> *abort) {
   ZSTD_DCtx *dctx = ZSTD_createDCtx();
   assert(dctx != nullptr);
 
   // Initialize input and output buffers
   ZSTD_inBuffer input = {in, in_size, 0};
-  std::string decompressedData;
   const size_t bufferSize = ZSTD_DStreamOutSize();  // recommended output buffer size
   std::string outputBuffer(bufferSize, '\0');
 
-  while (input.pos < input.size && !(abort && *abort)) {
+  bool stopped = false;
+  bool output_full = false;
+  // keep flushing while the output buffer comes back full, data may still be buffered in the context
+  while ((input.pos < input.size || output_full) && !(abort && *abort)) {
     ZSTD_outBuffer output = {outputBuffer.data(), bufferSize, 0};
 
     size_t result = ZSTD_decompressStream(dctx, &output, &input);
@@ -342,15 +541,205 @@ std::string decompressZST(const std::byte *in, size_t in_size, std::atomic<bool>
       break;
     }
 
-    decompressedData.append(outputBuffer.data(), output.pos);
+    output_full = output.pos == bufferSize;
+    if (output.pos > 0 && !callback(outputBuffer.data(), output.pos)) {
+      stopped = true;
+      break;
+    }
   }
 
   ZSTD_freeDCtx(dctx);
-  if (!(abort && *abort)) {
-    decompressedData.shrink_to_fit();
-    return decompressedData;
+  return !stopped && !(abort && *abort);
+}
+
+// class SeekableZstdWriter
+
+SeekableZstdWriter::SeekableZstdWriter(size_t frame_size, int level, int threads)
+    : frame_size_(frame_size), level_(level), threads_(std::max(1, threads)) {
+  if (threads_ > 1) {
+    for (int i = 0; i < threads_; ++i) {
+      workers_.emplace_back(&SeekableZstdWriter::workerThread, this);
+    }
+  }
+}
+
+SeekableZstdWriter::~SeekableZstdWriter() {
+  {
+    std::lock_guard lk(lock_);
+    exit_ = true;
+  }
+  cv_.notify_all();
+  for (auto &t : workers_) {
+    t.join();
+  }
+}
+
+void SeekableZstdWriter::workerThread() {
+  std::unique_lock lk(lock_);
+  while (true) {
+    cv_.wait(lk, [this]() { return exit_ || next_ < queued_.size(); });
+    if (exit_) return;
+
+    Frame *frame = queued_[next_++].get();
+    lk.unlock();
+    compress(*frame);
+    lk.lock();
+    frame->done = true;
+    cv_.notify_all();
+  }
+}
+
+void SeekableZstdWriter::compress(Frame &frame) {
+  frame.compressed.resize(ZSTD_compressBound(frame.data.size()));
+  size_t ret = ZSTD_compress(frame.compressed.data(), frame.compressed.size(), frame.data.data(), frame.data.size(), level_);
+  if (ZSTD_isError(ret)) {
+    rWarning("SeekableZstdWriter error: %s", ZSTD_getErrorName(ret));
+    failed_ = true;
+  } else {
+    frame.compressed.resize(ret);
+  }
+}
+
+bool SeekableZstdWriter::write(const char *data, size_t size) {
+  while (size > 0 && !failed_) {
+    const size_t n = std::min(size, frame_size_ - pending_.size());
+    pending_.append(data, n);
+    data += n;
+    size -= n;
+    if (pending_.size() == frame_size_) {
+      queueFrame();
+    }
+  }
+  return !failed_;
+}
+
+void SeekableZstdWriter::queueFrame() {
+  auto frame = std::make_unique<Frame>();
+  frame->data = std::move(pending_);
+  pending_.clear();
+  if (workers_.empty()) {
+    compress(*frame);
+    frame->done = true;
+  }
+  {
+    std::lock_guard lk(lock_);
+    queued_.push_back(std::move(frame));
+  }
+  cv_.notify_all();
+  // keep every worker busy while bounding the buffered frames
+  collect(threads_ * 2);
+}
+
+void SeekableZstdWriter::collect(size_t max) {
+  std::unique_lock lk(lock_);
+  while (true) {
+    while (!queued_.empty() && queued_.front()->done) {
+      const Frame &frame = *queued_.front();
+      if (!failed_) {
+        out_.append(frame.compressed);
+        frames_.push_back({(uint32_t)frame.compressed.size(), (uint32_t)frame.data.size()});
+      }
+      queued_.pop_front();
+      next_ = next_ > 0 ? next_ - 1 : 0;
+    }
+    if (queued_.size() <= max) break;
+    cv_.wait(lk);
+  }
+}
+
+std::string SeekableZstdWriter::finish() {
+  // compress the remaining frames, the last one may be smaller
+  if (!pending_.empty()) {
+    queueFrame();
+  }
+  collect(0);
+  if (failed_ || frames_.empty()) return {};
+
+  // skippable frame with the seek table, see the zstd seekable format
+  auto append_u32 = [this](uint32_t v) { out_.append((const char *)&v, sizeof(v)); };
+  append_u32(ZSTD_SEEKABLE_SKIPPABLE_MAGIC);
+  append_u32(frames_.size() * 8 + ZSTD_SEEKABLE_FOOTER_SIZE);
+  for (const auto &[compressed_size, decompressed_size] : frames_) {
+    append_u32(compressed_size);
+    append_u32(decompressed_size);
+  }
+  append_u32(frames_.size());
+  out_.push_back('\0');  // descriptor: no checksums
+  append_u32(ZSTD_SEEKABLE_MAGIC);
+  frames_.clear();
+  return std::move(out_);
+}
+
+bool readSeekableZstdFrames(const std::byte *in, size_t in_size, std::vector<SeekableZstdFrame> &frames) {
+  auto read_u32 = [in](size_t pos) {
+    uint32_t v;
+    memcpy(&v, in + pos, sizeof(v));
+    return v;
+  };
+  if (in_size < ZSTD_SEEKABLE_FOOTER_SIZE + 8 || read_u32(in_size - 4) != ZSTD_SEEKABLE_MAGIC) return false;
+
+  const size_t count = read_u32(in_size - ZSTD_SEEKABLE_FOOTER_SIZE);
+  const uint8_t descriptor = (uint8_t)in[in_size - 5];
+  const size_t entry_size = descriptor & 0x80 ? 12 : 8;
+  const size_t table_size = count * entry_size + ZSTD_SEEKABLE_FOOTER_SIZE + 8;
+  if (count == 0 || (descriptor & 0x7c) != 0 || table_size > in_size) return false;
+
+  const size_t table = in_size - table_size;
+  if (read_u32(table) != ZSTD_SEEKABLE_SKIPPABLE_MAGIC || read_u32(table + 4) != table_size - 8) return false;
+
+  frames.clear();
+  frames.reserve(count);
+  size_t compressed_offset = 0, offset = 0;
+  for (size_t i = 0; i < count; ++i) {
+    const size_t compressed_size = read_u32(table + 8 + i * entry_size);
+    const size_t size = read_u32(table + 8 + i * entry_size + 4);
+    frames.push_back({compressed_offset, compressed_size, offset, size});
+    compressed_offset += compressed_size;
+    offset += size;
+  }
+  return compressed_offset == table;
+}
+
+bool decompressZSTSeekable(const std::byte *in, size_t in_size, const std::vector<SeekableZstdFrame> &frames,
+                           size_t offset, size_t size, char *out, std::atomic<bool> *abort) {
+  auto first = std::upper_bound(frames.begin(), frames.end(), offset, [](size_t pos, const auto &f) { return pos < f.offset + f.size; });
+  auto last = std::lower_bound(first, frames.end(), offset + size, [](const auto &f, size_t pos) { return f.offset < pos; });
+  if (size == 0) return true;
+  if (first == frames.end() || std::prev(last)->offset + std::prev(last)->size < offset + size) return false;
+
+  std::atomic<size_t> next = 0;
+  std::atomic<bool> failed = false;
+  auto worker = [&]() {
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    std::string tmp;
+    for (size_t i = next++; first + i < last && !failed && !(abort && *abort); i = next++) {
+      const auto &f = *(first + i);
+      const size_t begin = std::max(offset, f.offset), end = std::min(offset + size, f.offset + f.size);
+      // frames that only partially overlap the range are decompressed aside
+      const bool whole = begin == f.offset && end == f.offset + f.size;
+      if (!whole) tmp.resize(f.size);
+      char *dst = whole ? out + (f.offset - offset) : tmp.data();
+      size_t ret = ZSTD_decompressDCtx(dctx, dst, f.size, in + f.compressed_offset, f.compressed_size);
+      if (ZSTD_isError(ret) || ret != f.size) {
+        rWarning("decompressZSTSeekable error: content is corrupt");
+        failed = true;
+      } else if (!whole) {
+        memcpy(out + (begin - offset), tmp.data() + (begin - f.offset), end - begin);
+      }
+    }
+    ZSTD_freeDCtx(dctx);
+  };
+
+  const int threads = std::min<int>(std::max(1u, std::thread::hardware_concurrency()), last - first);
+  std::vector<std::thread> workers;
+  for (int i = 1; i < threads; ++i) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : workers) {
+    t.join();
   }
-  return {};
+  return !failed && !(abort && *abort);
 }
 
 void precise_nano_sleep(int64_t nanoseconds, std::atomic<bool> &should_exit) {
@@ -372,6 +761,25 @@ void precise_nano_sleep(int64_t nanoseconds, std::atomic<bool> &should_exit) {
   }
 }
 
+void LatencyHistogram::add(double ms) {
+  ms = std::max(ms, 0.0);
+  ++buckets_[std::min<int>(ms, BUCKET_COUNT - 1)];
+  ++count_;
+  total_ms_ += ms;
+  max_ms_ = std::max(max_ms_, ms);
+}
+
+double LatencyHistogram::percentile(double p) const {
+  if (count_ == 0) return 0;
+
+  const uint64_t target = std::max<uint64_t>(1, std::ceil(count_ * std::clamp(p, 0.0, 100.0) / 100.0));
+  uint64_t n = 0;
+  for (int i = 0; i < BUCKET_COUNT - 1; ++i) {
+    if ((n += buckets_[i]) >= target) return std::min<double>(i + 1, max_ms_);
+  }
+  return max_ms_;
+}
+
 std::string sha256(const std::string &str) {
   unsigned char hash[SHA256_DIGEST_LENGTH];
   SHA256_CTX sha256;
@@ -389,6 +797,7 @@ void *MonotonicBuffer::allocate(size_t bytes, size_t alignment) {
   if (p == nullptr) {
     available = next_buffer_size = std::max(next_buffer_size, bytes);
     current_buf = buffers.emplace_back(std::aligned_alloc(alignment, next_buffer_size));
+    allocated_size += next_buffer_size;
     next_buffer_size *= growth_factor;
     p = current_buf;
   }
@@ -403,3 +812,28 @@ MonotonicBuffer::~MonotonicBuffer() {
     free(buf);
   }
 }
+
+// MappedFile
+
+MappedFile::MappedFile(const std::string &file) {
+  int fd = HANDLE_EINTR(open(file.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0) return;
+
+  struct stat st = {};
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      data_ = p;
+      size_ = st.st_size;
+    } else {
+      rWarning("failed to mmap %s: %s", file.c_str(), strerror(errno));
+    }
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (data_) {
+    munmap(data_, size_);
+  }
+}
@@ -1,9 +1,17 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <condition_variable>
 #include <deque>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 enum class ReplyMsgType {
   Info,
@@ -27,26 +35,126 @@ public:
   ~MonotonicBuffer();
   void *allocate(size_t bytes, size_t alignment = 16ul);
   void deallocate(void *p) {}
+  inline size_t allocatedSize() const { return allocated_size; }
 
 private:
   void *current_buf = nullptr;
+  size_t allocated_size = 0;
   size_t next_buffer_size = 0;
   size_t available = 0;
   std::deque<void *> buffers;
   static constexpr float growth_factor = 1.5;
 };
 
+// Read-only memory mapping of a local file. The mapping is page aligned, so it
+// can be handed to capnp readers directly. data() is null if the file could not be mapped.
+class MappedFile {
+public:
+  MappedFile(const std::string &file);
+  ~MappedFile();
+  inline const char *data() const { return (const char *)data_; }
+  inline size_t size() const { return size_; }
+
+private:
+  void *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Counts latencies in buckets of 1ms, the ones above the last bucket are counted in it.
+class LatencyHistogram {
+public:
+  void add(double ms);
+  // upper bound of the bucket of the p-th percentile (0-100) in ms, the maximum for the last bucket
+  double percentile(double p) const;
+  inline uint64_t count() const { return count_; }
+  inline double mean() const { return count_ > 0 ? total_ms_ / count_ : 0; }
+  inline double max() const { return max_ms_; }
+
+private:
+  static constexpr int BUCKET_COUNT = 200;
+  std::array<uint32_t, BUCKET_COUNT> buckets_ = {};
+  uint64_t count_ = 0;
+  double total_ms_ = 0;
+  double max_ms_ = 0;
+};
+
 std::string sha256(const std::string &str);
 void precise_nano_sleep(int64_t nanoseconds, std::atomic<bool> &should_exit);
 std::string decompressBZ2(const std::string &in, std::atomic<bool> *abort = nullptr);
 std::string decompressBZ2(const std::byte *in, size_t in_size, std::atomic<bool> *abort = nullptr);
 std::string decompressZST(const std::string &in, std::atomic<bool> *abort = nullptr);
 std::string decompressZST(const std::byte *in, size_t in_size, std::atomic<bool> *abort = nullptr);
+
+// Streaming decompression: the output is handed to the callback in chunks as soon as it is inflated.
+// The callback returns false to stop. Returns false if decompression failed, was aborted or stopped.
+typedef std::function<bool(const char *data, size_t size)> DecompressCallback;
+bool decompressBZ2(const std::byte *in, size_t in_size, const DecompressCallback &callback, std::atomic<bool> *abort = nullptr);
+bool decompressZST(const std::byte *in, size_t in_size, const DecompressCallback &callback, std::atomic<bool> *abort = nullptr);
+
+// Seekable zstd (the zstd seekable format): the content is compressed in independent frames, followed by a
+// skippable frame with the sizes of all frames. The frames can be decompressed in parallel or on their own,
+// while other zstd decoders still decompress the whole file as usual.
+class SeekableZstdWriter {
+public:
+  // with threads > 1, frames are compressed in parallel on that many workers owned by the writer
+  SeekableZstdWriter(size_t frame_size = 4 * 1024 * 1024, int level = 3, int threads = 1);
+  ~SeekableZstdWriter();
+  SeekableZstdWriter(const SeekableZstdWriter &) = delete;
+  SeekableZstdWriter &operator=(const SeekableZstdWriter &) = delete;
+  bool write(const char *data, size_t size);
+  // returns the compressed content, or an empty string if compression failed
+  std::string finish();
+
+private:
+  struct Frame {
+    std::string data;
+    std::string compressed;
+    bool done = false;
+  };
+  void workerThread();
+  void compress(Frame &frame);
+  void queueFrame();
+  // appends the compressed frames in order, waiting until at most max frames are queued
+  void collect(size_t max);
+
+  const size_t frame_size_;
+  const int level_;
+  const int threads_;
+  std::string pending_;
+  std::string out_;
+  std::vector<std::pair<uint32_t, uint32_t>> frames_;  // compressed and decompressed size of each frame
+  std::atomic<bool> failed_ = false;
+
+  std::mutex lock_;
+  std::condition_variable cv_;
+  std::deque<std::unique_ptr<Frame>> queued_;  // frames in order, until their output is appended
+  size_t next_ = 0;  // index in queued_ of the first frame not taken by a worker
+  bool exit_ = false;
+  std::vector<std::thread> workers_;
+};
+
+struct SeekableZstdFrame {
+  size_t compressed_offset;
+  size_t compressed_size;
+  size_t offset;  // in the decompressed content
+  size_t size;
+};
+// reads the frames of a seekable zstd file. returns false if it isn't one.
+bool readSeekableZstdFrames(const std::byte *in, size_t in_size, std::vector<SeekableZstdFrame> &frames);
+// decompresses the bytes [offset, offset + size) of the content into out. only the frames covering the range are
+// decompressed, on several threads.
+bool decompressZSTSeekable(const std::byte *in, size_t in_size, const std::vector<SeekableZstdFrame> &frames,
+                           size_t offset, size_t size, char *out, std::atomic<bool> *abort = nullptr);
+
 std::string getUrlWithoutQuery(const std::string &url);
-size_t getRemoteFileSize(const std::string &url, std::atomic<bool> *abort = nullptr);
-std::string httpGet(const std::string &url, size_t chunk_size = 0, std::atomic<bool> *abort = nullptr);
+// validator is set to the ETag of the file, or its Last-Modified date if it has no strong ETag, empty if neither is sent
+size_t getRemoteFileSize(const std::string &url, std::atomic<bool> *abort = nullptr, std::string *validator = nullptr);
+// ranges of chunk_size are downloaded on parallel connections, each range is retried up to retries times
+std::string httpGet(const std::string &url, size_t chunk_size = 0, std::atomic<bool> *abort = nullptr, int retries = 3);
 
 typedef std::function<void(uint64_t cur, uint64_t total, bool success)> DownloadProgressHandler;
 void installDownloadProgressHandler(DownloadProgressHandler);
-bool httpDownload(const std::string &url, const std::string &file, size_t chunk_size = 0, std::atomic<bool> *abort = nullptr);
+// an existing file is taken as the beginning of the download, which continues from its end if the remote file
+// hasn't changed since. The validator of the remote file is kept in file + ".validator" while it is incomplete.
+bool httpDownload(const std::string &url, const std::string &file, size_t chunk_size = 0, std::atomic<bool> *abort = nullptr, int retries = 3);
 std::string formattedDataSize(size_t size);